@@ -1,115 +1,248 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FORMICINE_SIMD_X86
+#endif
+
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "ansi.h"
 
 namespace ansi {
-	std::ofstream dbgout(".log", std::ofstream::app);
-	ansistream dbgstream(dbgout, dbgout);
-	ansistream out(std::cout, std::cerr);
+	namespace {
+		/** Writer IDs start at 1 so that 0 can mean that concurrent mode is disabled. */
+		std::atomic<uint64_t> next_writer_id = 1;
 
-	std::string format(const std::string &str) {
-		std::string out;
-		out.reserve(str.length() * 1.1);
-		const size_t length = str.length();
-		for (size_t i = 0; i < length; ++i) {
-			const char ch = str[i];
-			const size_t remaining = length - i - 1;
-			if (ch != '^' || remaining == 0) {
-				out.push_back(ch);
-				continue;
+		using escape_finder = const char * (*)(const char *, const char *, bool);
+
+		const char * find_escape_scalar(const char *begin, const char *end, bool carets) {
+			for (; begin != end; ++begin) {
+				if (*begin == '\x1b' || (carets && *begin == '^'))
+					return begin;
 			}
 
-			const char next = str[++i];
-
-			if (next == '^') {
-				out += ch;
-				continue;
-			} else if (next == 'b') {
-				out += style_codes.at(style::bold);
-			} else if (next == 'd') {
-				out += style_codes.at(style::dim);
-			} else if (next == 'u') {
-				out += style_codes.at(style::underline);
-			} else if (next == 'i') {
-				out += style_codes.at(style::italic);
-			} else if (next == 'B') {
-				out += style_resets.at(style::bold);
-			} else if (next == 'D') {
-				out += style_resets.at(style::dim);
-			} else if (next == 'U') {
-				out += style_resets.at(style::underline);
-			} else if (next == 'I') {
-				out += style_resets.at(style::italic);
-			} else if (next == '0') {
-				out += reset_all;
-			} else if (next == '[' && 3 <= remaining) {
-				const size_t close_pos = str.find(']', i + 2);
-				std::string type = str.substr(i + 1, close_pos - (i + 1));
-				bool bright = false;
-				if (type.back() == '!') {
-					bright = true;
-					type.pop_back();
+			return end;
+		}
+
+#ifdef FORMICINE_SIMD_X86
+		__attribute__((target("sse2")))
+		const char * find_escape_sse2(const char *begin, const char *end, bool carets) {
+			const __m128i escape = _mm_set1_epi8('\x1b');
+			const __m128i caret  = _mm_set1_epi8(carets? '^' : '\x1b');
+			for (; 16 <= end - begin; begin += 16) {
+				const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+				const int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, escape),
+					_mm_cmpeq_epi8(chunk, caret)));
+				if (mask != 0)
+					return begin + __builtin_ctz(mask);
+			}
+
+			return find_escape_scalar(begin, end, carets);
+		}
+
+		__attribute__((target("avx2")))
+		const char * find_escape_avx2(const char *begin, const char *end, bool carets) {
+			const __m256i escape = _mm256_set1_epi8('\x1b');
+			const __m256i caret  = _mm256_set1_epi8(carets? '^' : '\x1b');
+			for (; 32 <= end - begin; begin += 32) {
+				const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+				const unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, escape),
+					_mm256_cmpeq_epi8(chunk, caret)));
+				if (mask != 0)
+					return begin + __builtin_ctz(mask);
+			}
+
+			return find_escape_sse2(begin, end, carets);
+		}
+#endif
+
+		/** Returns the SGR parameter of a style or style reset escape: "\e[22m" -> "22". */
+		constexpr std::string_view sgr_parameter(std::string_view escape) {
+			return escape.substr(2, escape.size() - 3);
+		}
+
+		/** Writes the shortest single SGR escape that changes the attributes in effect from one state to another
+		 *  and returns its length (at most 66). Chooses between a diff and a full reset followed by the new
+		 *  attributes. */
+		size_t build_sgr(const sgr_state &from, const sgr_state &to, char *out) {
+			auto write_parameters = [](const sgr_state &from, const sgr_state &to, bool reset, char *out) {
+				size_t length = 0;
+				auto add = [&](std::string_view parameter) {
+					out[length] = length == 0? '[' : ';';
+					++length;
+					parameter.copy(out + length, parameter.size());
+					length += parameter.size();
+				};
+
+				const sgr_state &base = reset? sgr_state {} : from;
+				if (reset)
+					add("0");
+
+				uint8_t added = to.styles & ~base.styles;
+				const uint8_t removed = base.styles & ~to.styles;
+				const uint8_t intensity = style_bit(style::bold) | style_bit(style::dim);
+				if (removed & intensity) {
+					// Bold and dim share a reset code, so whichever of them is still wanted has to be reapplied.
+					add(sgr_parameter(style_resets[style::bold]));
+					added |= to.styles & intensity;
 				}
 
-				color col = get_color(type);
-
-				if (type == "/f") {
-					out += reset_fg;
-				} else if (type == "/b") {
-					out += reset_bg;
-				} else if (type.front() == ':') {
-					col = get_color(type.substr(1));
-					if (col == color::normal && type != "normal")
-						throw std::invalid_argument("Invalid format identifier");
-					out += get_bg(col, bright);
-				} else if (col == color::normal && type != "normal") {
-					throw std::invalid_argument("Invalid format identifier");
-				} else {
-					out += get_fg(col, bright);
+				for (size_t i = 0; i < style_count; ++i) {
+					const style current = static_cast<style>(i);
+					if ((removed & style_bit(current)) && !(style_bit(current) & intensity))
+						add(sgr_parameter(style_resets[current]));
+				}
+
+				for (size_t i = 0; i < style_count; ++i) {
+					const style current = static_cast<style>(i);
+					if (added & style_bit(current))
+						add(sgr_parameter(style_codes[current]));
 				}
 
-				i = close_pos;
-			} else {
-				throw std::invalid_argument("Invalid next character in format");
+				if (to.fg != base.fg)
+					add(sgr_parameter(get_fg(to.fg)));
+				if (to.bg != base.bg)
+					add(sgr_parameter(get_bg(to.bg)));
+
+				return length;
+			};
+
+			char diff[64], reset[64];
+			const size_t diff_length  = write_parameters(from, to, false, diff);
+			const size_t reset_length = write_parameters(from, to, true, reset);
+			const bool use_reset = reset_length < diff_length;
+			const size_t length = use_reset? reset_length : diff_length;
+			out[0] = '\x1b';
+			std::memcpy(out + 1, use_reset? reset : diff, length);
+			out[length + 1] = 'm';
+			return length + 2;
+		}
+
+		bool supports(detail::escape_kernel kernel) {
+#ifdef FORMICINE_SIMD_X86
+			__builtin_cpu_init();
+			switch (kernel) {
+				case detail::escape_kernel::avx2: return __builtin_cpu_supports("avx2");
+				case detail::escape_kernel::sse2: return __builtin_cpu_supports("sse2");
+				default: return true;
 			}
+#else
+			return kernel == detail::escape_kernel::scalar;
+#endif
 		}
 
-		return out;
+		escape_finder get_escape_finder(detail::escape_kernel kernel) {
+#ifdef FORMICINE_SIMD_X86
+			if (kernel == detail::escape_kernel::avx2)
+				return find_escape_avx2;
+			if (kernel == detail::escape_kernel::sse2)
+				return find_escape_sse2;
+#endif
+			return find_escape_scalar;
+		}
+
+		/** The escape finder in use, chosen the first time it's needed. */
+		std::atomic<escape_finder> & current_escape_finder() {
+			static std::atomic<escape_finder> finder = [] {
+				for (const auto kernel: {detail::escape_kernel::avx2, detail::escape_kernel::sse2})
+					if (supports(kernel))
+						return get_escape_finder(kernel);
+				return get_escape_finder(detail::escape_kernel::scalar);
+			}();
+			return finder;
+		}
 	}
 
-	color_pair fg(ansi::color color) { return {color, color_type::foreground}; }
-	color_pair bg(ansi::color color) { return {color, color_type::background}; }
+	namespace detail {
+		const char * find_escape(const char *begin, const char *end, bool carets) {
+			return current_escape_finder().load(std::memory_order_relaxed)(begin, end, carets);
+		}
 
-	std::string get_fg(ansi::color color, bool bright) {
-		const std::string &base = color_bases.at(color);
-		if (bright && base.size() == 1)
-			return "\e[9" + base + "m";
-		return "\e[3" + base + "m";
+		escape_kernel get_escape_kernel() {
+			const escape_finder finder = current_escape_finder().load(std::memory_order_relaxed);
+			for (const auto kernel: {escape_kernel::avx2, escape_kernel::sse2})
+				if (supports(kernel) && finder == get_escape_finder(kernel))
+					return kernel;
+			return escape_kernel::scalar;
+		}
+
+		bool set_escape_kernel(escape_kernel kernel) {
+			if (!supports(kernel))
+				return false;
+			current_escape_finder().store(get_escape_finder(kernel), std::memory_order_relaxed);
+			return true;
+		}
+
+		size_t skip_escape(std::string_view str, size_t pos, bool carets) {
+			const size_t length = str.length();
+			if (carets && str[pos] == '^') {
+				// A ^ at the end does nothing.
+				if (pos + 1 == length)
+					return length;
+				if (str[pos + 1] == '[') {
+					const size_t close = str.find(']', pos + 1);
+					return close == std::string_view::npos? length : close + 1;
+				}
+				return pos + 2;
+			}
+
+			// If there's only this \x1b character and the next, there's nothing left to do.
+			if (pos + 2 == length)
+				return std::string::npos;
+
+			if (pos + 1 < length && str[pos + 1] == '[') {
+				size_t i = pos + 2;
+				while (i < length && (str[i] < 0x40 || 0x7e < str[i]))
+					++i;
+				return i < length? i + 1 : length;
+			}
+
+			return pos + 1;
+		}
 	}
 
-	std::string get_bg(ansi::color color, bool bright) {
-		const std::string &base = color_bases.at(color);
-		if (bright && base.size() == 1)
-			return "\e[10" + base + "m";
-		return "\e[4" + base + "m";
+	std::ofstream dbgout(".log", std::ofstream::app);
+	ansistream dbgstream(dbgout, dbgout);
+	ansistream out(std::cout, std::cerr);
+
+	std::string format(std::string_view str) {
+		std::string out;
+		out.reserve(str.length() * 1.1);
+		format_to(out, str);
+		return out;
 	}
 
+	color_pair fg(ansi::color color) { return {color, color_type::foreground}; }
+	color_pair bg(ansi::color color) { return {color, color_type::background}; }
+
 	ansi_pair<style> remove(ansi::style style) {
 		return {style, false};
 	}
 
-	std::string wrap(const std::string &str, const ansi::color_pair &pair) {
-		return pair.left() + str + pair.right();
+	std::string wrap(std::string_view str, const ansi::color_pair &pair) {
+		std::string out;
+		out.reserve(str.length() + 16);
+		wrap_to(out, str, pair);
+		return out;
 	}
 
-	std::string wrap(const std::string &str, const ansi::color &color) {
+	std::string wrap(std::string_view str, const ansi::color &color) {
 		return wrap(str, color_pair(color));
 	}
 
-	std::string wrap(const std::string &str, const ansi::style &style) {
-		return style_codes.at(style) + str + style_resets.at(style);
+	std::string wrap(std::string_view str, const ansi::style &style) {
+		std::string out;
+		out.reserve(str.length() + 10);
+		wrap_to(out, str, style);
+		return out;
 	}
 
 	void write(std::ostream &os, const std::string &str) {
@@ -122,117 +255,112 @@ namespace ansi {
 	}
 
 	std::string get_name(ansi::color color) {
-		return get_fg(color) + color_names.at(color) + reset_fg;
-	}
-
-	ansi::color get_color(const std::string &name) {
-		for (const auto &pair: color_names) {
-			if (pair.second == name)
-				return pair.first;
-		}
-
-		return ansi::color::normal;
+		std::string out;
+		out.reserve(32);
+		out += get_fg(color);
+		out += color_names.at(color);
+		out += reset_fg;
+		return out;
 	}
 
-	bool has_color(const std::string &name) {
-		for (const auto &pair: color_names) {
-			if (pair.second == name)
-				return true;
-		}
-
-		return false;
-	}
-
-	std::string strip(const std::string &str) {
-		std::string out = "";
-		size_t len = str.length();
-		char c;
-		for (size_t i = 0; i < len; ++i) {
-			c = str[i];
-
-			if (c == '\x1b') {
-				// If there's only this \x1b character and the next, there's nothing left to do.
-				if (i == len - 2) break;
-				if (str[i + 1] == '[')
-					for (i += 2; str[i] < 0x40 || 0x7e < str[i]; ++i);
-			} else if (c == '^') {
-				++i;
-				if (i == len) break; // A ^ at the end does nothing.
-				if (str[i] == '[')
-					i = str.find(']', i);
-			} else {
-				out.push_back(c);
-				continue;
-			}
-		}
-
+	std::string strip(std::string_view str) {
+		std::string out;
+		out.reserve(str.length());
+		strip_to(out, str);
 		return out;
 	}
 
-	std::string substr(const std::string &str, size_t pos, size_t n) {
-		const size_t start = get_pos(str, pos);
+	std::string substr(std::string_view str, size_t pos, size_t n) {
 		if (n == std::string::npos)
-			return str.substr(start);
-		return str.substr(start, get_pos(str, pos + n) - start);
-	}
-
-	size_t length(const std::string &str) {
-		size_t i = 0, length = str.length(), counted = 0;
-		for (; i < length; ++i) {
-			if (str[i] != '\x1b') {
-				++counted;
-			} else {
-				if (i == length - 2) break;
-				if (str[i + 1] == '[')
-					for (i += 2; str[i] < 0x40 || 0x7e < str[i]; ++i);
-			}
-		}
+			return std::string(str.substr(get_pos(str, pos)));
+		const auto [start, end] = get_pos_pair(str, pos, pos + n);
+		return std::string(str.substr(start, end - start));
+	}
 
+	size_t length(std::string_view str) {
+		size_t counted = 0;
+		detail::for_each_run(str, false, [&](size_t start, size_t end) {
+			counted += end - start;
+			return true;
+		});
 		return counted;
 	}
 
 	std::string & erase(std::string &str, size_t pos, size_t len) {
-		const size_t start = get_pos(str, pos);
 		if (len == std::string::npos)
-			return str.erase(start);
-		return str.erase(start, get_pos(str, pos + len) - start);
+			return str.erase(get_pos(str, pos));
+		const auto [start, end] = get_pos_pair(str, pos, pos + len);
+		return str.erase(start, end - start);
 	}
 
-	size_t get_pos(const std::string &str, size_t old_pos) {
-		if (old_pos == std::string::npos)
-			return old_pos;
-		const size_t length = str.length();
-		size_t i, counted = 0;
-		for (i = 0; i < length && counted != old_pos; ++i) {
-			if (str[i] != '\x1b') {
-				++counted;
-			} else {
-				if (i == length - 2) break;
-				if (str[i + 1] == '[')
-					for (i += 2; str[i] < 0x40 || 0x7e < str[i]; ++i);
-			}
+	size_t get_pos(std::string_view str, size_t old_pos) {
+		return get_pos_pair(str, old_pos, old_pos).first;
+	}
+
+	std::pair<size_t, size_t> get_pos_pair(std::string_view str, size_t first, size_t second) {
+		const size_t targets[2] = {first, second};
+		size_t found[2] = {std::string::npos, std::string::npos};
+		int next = 0;
+
+		// Positions of zero are never adjusted, even if the string starts with an escape.
+		while (next < 2 && targets[next] == 0)
+			found[next++] = 0;
+
+		if (next < 2 && targets[next] != std::string::npos) {
+			size_t counted = 0;
+			const size_t stop = detail::for_each_run(str, false, [&](size_t start, size_t end) {
+				const size_t run_length = end - start;
+				for (; next < 2 && targets[next] <= counted + run_length; ++next)
+					found[next] = start + (targets[next] - counted);
+				counted += run_length;
+				return next < 2;
+			});
+
+			for (; next < 2; ++next)
+				if (targets[next] != std::string::npos)
+					found[next] = stop;
 		}
 
-		return i;
+		return {found[0], found[1]};
+	}
+
+	std::string strip(const styled_string &str) {
+		return strip(str.str());
+	}
+
+	std::string substr(const styled_string &str, size_t pos, size_t n) {
+		return str.substr(pos, n);
 	}
 
-	std::string bold(const std::string &str) {
+	size_t length(const styled_string &str) {
+		return str.length();
+	}
+
+	styled_string & erase(styled_string &str, size_t pos, size_t len) {
+		return str.erase(pos, len);
+	}
+
+	size_t get_pos(const styled_string &str, size_t old_pos) {
+		return str.get_pos(old_pos);
+	}
+
+	std::string bold(std::string_view str) {
 		return wrap(str, style::bold);
 	}
 
-	std::string dim(const std::string &str) {
+	std::string dim(std::string_view str) {
 		return wrap(str, style::dim);
 	}
 
-	std::string underline(const std::string &str) {
+	std::string underline(std::string_view str) {
 		return wrap(str, style::underline);
 	}
 
-	std::string italic(const std::string &str) {
+	std::string italic(std::string_view str) {
 		return wrap(str, style::italic);
 	}
 
-#define MKCOLOR(x) std::string x(const std::string &str) { return wrap(str, color::x); }
+#define MKCOLOR(x) std::string x(std::string_view str) { return wrap(str, color::x); }
 	MKCOLOR(red)
 	MKCOLOR(orange)
 	MKCOLOR(yellow)
@@ -249,25 +377,578 @@ namespace ansi {
 	MKCOLOR(pink)
 	MKCOLOR(sky)
 	MKCOLOR(verydark)
+	MKCOLOR(blood)
 #undef MKCOLOR
 
-	std::string color_pair::left() const {
+	std::string_view color_pair::left() const {
 		return type == color_type::background? get_bg(color) : get_fg(color);
 	}
 
-	std::string color_pair::right() const {
-		return type == color_type::background? reset_bg : reset_fg;
+	std::string_view color_pair::right() const {
+		return type == color_type::background? detail::format_reset_bg : detail::format_reset_fg;
+	}
+
+	styled_string::styled_string(std::string text_): text(std::move(text_)) {
+		reindex();
+	}
+
+	styled_string::styled_string(const char *text_): text(text_) {
+		reindex();
+	}
+
+	styled_string & styled_string::operator=(std::string text_) {
+		text = std::move(text_);
+		reindex();
+		return *this;
+	}
+
+	void styled_string::reindex() {
+		runs.clear();
+		size_t column = 0;
+		stop = detail::for_each_run(text, false, [&](size_t start, size_t end) {
+			runs.push_back({start, column, end - start});
+			column += end - start;
+			return true;
+		});
+	}
+
+	void styled_string::reindex(size_t pos, size_t removed, size_t inserted) {
+		const ssize_t delta = static_cast<ssize_t>(inserted) - static_cast<ssize_t>(removed);
+
+		// Rescanning has to start from a point where the scanner isn't inside an escape: anywhere inside a run or
+		// at the end of one. A \x1b that's second to last stops the scan, so that position is rescanned too.
+		const size_t limit = std::min(pos, 2 <= text.size()? text.size() - 2 : 0);
+		auto first = std::partition_point(runs.begin(), runs.end(), [&](const run &r) { return r.start <= limit; });
+		size_t restart = 0, column = 0;
+		std::vector<run> new_runs;
+		if (first != runs.begin()) {
+			--first;
+			restart = std::min(limit, first->start + first->length);
+			column = first->column + (restart - first->start);
+			if (first->start < restart)
+				new_runs.push_back({first->start, first->column, restart - first->start});
+		}
+
+		// Runs that begin after the edited bytes are still valid once shifted. As soon as the rescan produces a run
+		// that starts where one of them now starts, everything after it is unchanged.
+		auto tail = std::partition_point(first, runs.end(), [&](const run &r) { return r.start < pos + removed; });
+		bool aligned = false;
+		const size_t new_stop = detail::for_each_run(std::string_view(text).substr(restart), false,
+			[&](size_t start, size_t end) {
+				start += restart;
+				end += restart;
+				while (tail != runs.end() && tail->start + delta < start)
+					++tail;
+				if (tail != runs.end() && tail->start + delta == start) {
+					aligned = true;
+					return false;
+				}
+				if (!new_runs.empty() && new_runs.back().start + new_runs.back().length == start)
+					new_runs.back().length += end - start;
+				else
+					new_runs.push_back({start, column, end - start});
+				column += end - start;
+				return true;
+			});
+
+		if (aligned) {
+			const ssize_t column_delta = static_cast<ssize_t>(column) - static_cast<ssize_t>(tail->column);
+			for (auto iter = tail; iter != runs.end(); ++iter) {
+				iter->start += delta;
+				iter->column += column_delta;
+			}
+			stop += delta;
+			// The rescan may have ended right where the first unchanged run begins.
+			if (!new_runs.empty() && new_runs.back().start + new_runs.back().length == tail->start) {
+				new_runs.back().length += tail->length;
+				++tail;
+			}
+		} else {
+			tail = runs.end();
+			stop = restart + new_stop;
+		}
+
+		const auto first_index = first - runs.begin();
+		runs.erase(first, tail);
+		runs.insert(runs.begin() + first_index, new_runs.begin(), new_runs.end());
+	}
+
+	size_t styled_string::length() const {
+		return runs.empty()? 0 : runs.back().column + runs.back().length;
+	}
+
+	size_t styled_string::get_pos(size_t old_pos) const {
+		if (old_pos == std::string::npos || old_pos == 0)
+			return old_pos;
+		const auto iter = std::partition_point(runs.begin(), runs.end(), [&](const run &r) {
+			return r.column + r.length < old_pos;
+		});
+		return iter == runs.end()? stop : iter->start + (old_pos - iter->column);
+	}
+
+	std::string styled_string::substr(size_t pos, size_t n) const {
+		const size_t start = get_pos(pos);
+		if (n == std::string::npos)
+			return text.substr(start);
+		return text.substr(start, get_pos(pos + n) - start);
+	}
+
+	styled_string & styled_string::insert(size_t pos, std::string_view str) {
+		const size_t byte = get_pos(pos);
+		text.insert(byte, str);
+		reindex(byte, 0, str.size());
+		return *this;
+	}
+
+	styled_string & styled_string::insert(size_t pos, char ch) {
+		return insert(pos, std::string_view(&ch, 1));
+	}
+
+	styled_string & styled_string::erase(size_t pos, size_t len) {
+		const size_t start = get_pos(pos);
+		const size_t end = len == std::string::npos? text.size() : get_pos(pos + len);
+		text.erase(start, end - start);
+		reindex(start, end - start, 0);
+		return *this;
+	}
+
+	styled_string & styled_string::append(std::string_view str) {
+		const size_t old_size = text.size();
+		text += str;
+		reindex(old_size, 0, str.size());
+		return *this;
+	}
+
+	styled_string & styled_string::operator+=(std::string_view str) {
+		return append(str);
+	}
+
+	write_buffer::write_buffer(int fd_, flush_policy policy_, size_t threshold_):
+		fd(fd_), policy(policy_), threshold(threshold_) {
+			buffer.reserve(threshold);
+		}
+
+	write_buffer::write_buffer(std::ostream &target_, flush_policy policy_, size_t threshold_):
+		target(&target_), policy(policy_), threshold(threshold_) {
+			buffer.reserve(threshold);
+		}
+
+	write_buffer::~write_buffer() {
+		flush();
+	}
+
+	void write_buffer::flush() {
+		if (buffer.empty())
+			return;
+
+		if (target) {
+			target->write(buffer.data(), buffer.size());
+			target->flush();
+		} else {
+			const char *data = buffer.data();
+			size_t remaining = buffer.size();
+			while (0 < remaining) {
+				const ssize_t written = ::write(fd, data, remaining);
+				if (written < 0) {
+					if (errno == EINTR)
+						continue;
+					break;
+				}
+				data += written;
+				remaining -= written;
+			}
+		}
+
+		++counters.flushes;
+		counters.bytes += buffer.size();
+		buffer.clear();
+	}
+
+	void write_buffer::flush_point() {
+		if (policy == flush_policy::immediate)
+			flush();
+	}
+
+	void write_buffer::end_frame() {
+		if (policy == flush_policy::frame)
+			flush();
+	}
+
+	void write_buffer::appended(const char *data, size_t size) {
+		if ((policy == flush_policy::line && std::memchr(data, '\n', size) != nullptr)
+		    || (policy == flush_policy::bytes && threshold <= buffer.size()))
+			flush();
+	}
+
+	write_buffer::int_type write_buffer::overflow(int_type ch) {
+		if (traits_type::eq_int_type(ch, traits_type::eof()))
+			return traits_type::not_eof(ch);
+		const char c = traits_type::to_char_type(ch);
+		buffer.push_back(c);
+		appended(&c, 1);
+		return ch;
+	}
+
+	std::streamsize write_buffer::xsputn(const char *data, std::streamsize size) {
+		buffer.append(data, size);
+		appended(data, size);
+		return size;
+	}
+
+	int write_buffer::sync() {
+		// std::endl and std::flush end up here.
+		flush_point();
+		return 0;
+	}
+
+	line_writer::line_writer(int fd_): head(&stub), tail(&stub), fd(fd_) {
+		thread = std::thread(&line_writer::run, this);
+	}
+
+	line_writer::line_writer(std::ostream &target_): head(&stub), tail(&stub), target(&target_) {
+		thread = std::thread(&line_writer::run, this);
+	}
+
+	line_writer::~line_writer() {
+		stop();
+		// Whatever was submitted after the writer thread stopped is discarded.
+		while (node *discarded = pop())
+			delete discarded;
 	}
 
+	void line_writer::submit(std::string &&text) {
+		if (text.empty())
+			return;
+
+		node *added = new node;
+		added->text = std::move(text);
+		push(added);
+
+		// Only the first producer since the writer thread last started draining needs to wake it up.
+		if (pending.exchange(1, std::memory_order_acq_rel) == 0)
+			pending.notify_one();
+	}
+
+	void line_writer::stop() {
+		if (!thread.joinable())
+			return;
+		stopping.store(true, std::memory_order_release);
+		pending.store(1, std::memory_order_release);
+		pending.notify_one();
+		thread.join();
+	}
+
+	line_writer::stats line_writer::get_stats() const {
+		return {batches.load(std::memory_order_relaxed), chunks.load(std::memory_order_relaxed),
+			bytes.load(std::memory_order_relaxed)};
+	}
+
+	void line_writer::push(node *added) {
+		added->next.store(nullptr, std::memory_order_relaxed);
+		node *previous = head.exchange(added, std::memory_order_acq_rel);
+		previous->next.store(added, std::memory_order_release);
+	}
+
+	line_writer::node * line_writer::pop() {
+		node *first = tail;
+		node *next = first->next.load(std::memory_order_acquire);
+
+		if (first == &stub) {
+			if (next == nullptr)
+				return nullptr;
+			tail = first = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+
+		if (next != nullptr) {
+			tail = next;
+			return first;
+		}
+
+		// A producer has taken the head but hasn't linked it yet. It will wake the writer thread once it has.
+		if (first != head.load(std::memory_order_acquire))
+			return nullptr;
+
+		// The first node is also the last one. Queue the stub behind it so that it can be unlinked.
+		push(&stub);
+		next = first->next.load(std::memory_order_acquire);
+		if (next != nullptr) {
+			tail = next;
+			return first;
+		}
+
+		return nullptr;
+	}
+
+	void line_writer::run() {
+		for (;;) {
+			// Clearing the flag before draining means that anything pushed after the drain misses it will set the
+			// flag again and the wait below will return immediately.
+			pending.exchange(0, std::memory_order_acq_rel);
+			drain();
+			if (stopping.load(std::memory_order_acquire)) {
+				drain();
+				return;
+			}
+			pending.wait(0, std::memory_order_acquire);
+		}
+	}
+
+	bool line_writer::drain() {
+		std::array<node *, 64> batch;
+		size_t count = 0;
+		bool any = false;
+
+		while (node *popped = pop()) {
+			batch[count++] = popped;
+			any = true;
+			if (count == batch.size()) {
+				write_out(batch.data(), count);
+				count = 0;
+			}
+		}
+
+		if (count != 0)
+			write_out(batch.data(), count);
+
+		return any;
+	}
+
+	void line_writer::write_out(node **nodes, size_t count) {
+		size_t total = 0;
+
+		if (target) {
+			for (size_t i = 0; i < count; ++i) {
+				target->write(nodes[i]->text.data(), nodes[i]->text.size());
+				total += nodes[i]->text.size();
+			}
+			target->flush();
+		} else {
+			std::array<iovec, 64> vectors;
+			for (size_t i = 0; i < count; ++i) {
+				vectors[i] = {nodes[i]->text.data(), nodes[i]->text.size()};
+				total += nodes[i]->text.size();
+			}
+
+			size_t first = 0;
+			while (first < count) {
+				const ssize_t written = ::writev(fd, vectors.data() + first, count - first);
+				if (written < 0) {
+					if (errno == EINTR)
+						continue;
+					break;
+				}
+
+				// Skip past whatever was written and resume from the middle of a partially written chunk.
+				size_t remaining = written;
+				while (first < count && vectors[first].iov_len <= remaining)
+					remaining -= vectors[first++].iov_len;
+				if (first < count) {
+					vectors[first].iov_base = static_cast<char *>(vectors[first].iov_base) + remaining;
+					vectors[first].iov_len -= remaining;
+				}
+			}
+		}
+
+		for (size_t i = 0; i < count; ++i)
+			delete nodes[i];
+
+		batches.fetch_add(1, std::memory_order_relaxed);
+		chunks.fetch_add(count, std::memory_order_relaxed);
+		bytes.fetch_add(total, std::memory_order_relaxed);
+	}
+
+	struct ansistream::thread_context {
+		/** Collects a thread's output and submits it to the writer a line at a time. */
+		class line_buffer: public std::streambuf {
+			public:
+				line_buffer(std::shared_ptr<line_writer> writer_): writer(std::move(writer_)) {}
+
+				~line_buffer() override {
+					submit_all();
+				}
+
+				bool writer_stopped() const {
+					return writer->stopped();
+				}
+
+				/** Submits everything collected so far, including a partial line. */
+				void submit_all() {
+					if (!line.empty()) {
+						writer->submit(std::move(line));
+						line.clear();
+					}
+				}
+
+			protected:
+				int_type overflow(int_type ch) override {
+					if (traits_type::eq_int_type(ch, traits_type::eof()))
+						return traits_type::not_eof(ch);
+					const char c = traits_type::to_char_type(ch);
+					line.push_back(c);
+					if (c == '\n')
+						submit_lines();
+					return ch;
+				}
+
+				std::streamsize xsputn(const char *data, std::streamsize size) override {
+					line.append(data, size);
+					if (std::memchr(data, '\n', size) != nullptr)
+						submit_lines();
+					return size;
+				}
+
+				int sync() override {
+					// Complete lines have already been submitted, and partial lines wait for the rest of the line.
+					return 0;
+				}
+
+			private:
+				std::shared_ptr<line_writer> writer;
+				std::string line;
+
+				/** Submits every complete line and keeps the partial line after them, if any. */
+				void submit_lines() {
+					const size_t end = line.rfind('\n') + 1;
+					if (end == line.size()) {
+						writer->submit(std::move(line));
+						line.clear();
+					} else {
+						writer->submit(line.substr(0, end));
+						line.erase(0, end);
+					}
+				}
+		};
+
+		output_state state;
+		line_buffer buffer;
+		std::ostream out;
+
+		thread_context(std::shared_ptr<line_writer> writer): buffer(std::move(writer)), out(&buffer) {}
+	};
+
+	struct ansistream::context_registry {
+		std::unordered_map<uint64_t, std::unique_ptr<thread_context>> contexts;
+		/** Contexts are keyed by writer ID rather than by the stream's address so that one is never picked up by a
+		 *  different stream or writer at the same address. */
+		uint64_t cached_id = 0;
+		thread_context *cached = nullptr;
+
+		context_registry() {
+			local_registry = this;
+		}
+
+		~context_registry() {
+			// The pointer and flag are trivially destructible, so they can still be checked after this.
+			local_registry = nullptr;
+			registry_destroyed = true;
+		}
+	};
+
+	thread_local ansistream::context_registry *ansistream::local_registry = nullptr;
+	thread_local bool ansistream::registry_destroyed = false;
+
 	ansistream::ansistream(): content_out(std::cout), style_out(std::cerr) {}
 
+	ansistream::ansistream(std::ostream &stream): content_out(stream), style_out(stream) {}
+
+	ansistream::ansistream(std::ostream &c, std::ostream &s): content_out(c), style_out(s) {}
+
+	ansistream::~ansistream() {
+		disable_concurrency();
+		disable_buffering();
+	}
+
 
 // Private instance methods
 
 
+	ansistream::thread_context & ansistream::context() {
+		if (local_registry != nullptr && local_registry->cached_id == writer_id)
+			return *local_registry->cached;
+
+		if (registry_destroyed) {
+			std::lock_guard lock(exiting_mutex);
+			if (!exiting_context)
+				exiting_context = std::make_unique<thread_context>(writer);
+			return *exiting_context;
+		}
+
+		thread_local context_registry registry;
+		// Contexts for writers that have been stopped since are dropped here, along with their references to them.
+		std::erase_if(registry.contexts, [](const auto &entry) { return entry.second->buffer.writer_stopped(); });
+		std::unique_ptr<thread_context> &found = registry.contexts[writer_id];
+		if (!found)
+			found = std::make_unique<thread_context>(writer);
+		registry.cached_id = writer_id;
+		registry.cached = found.get();
+		return *registry.cached;
+	}
+
+	void ansistream::drop_context() {
+		// Destroying a context submits its partial line.
+		if (local_registry != nullptr) {
+			if (local_registry->cached_id == writer_id) {
+				local_registry->cached_id = 0;
+				local_registry->cached = nullptr;
+			}
+			local_registry->contexts.erase(writer_id);
+		}
+
+		std::lock_guard lock(exiting_mutex);
+		exiting_context.reset();
+	}
+
+	ansistream::output_state & ansistream::state() {
+		return writer? context().state : shared_state;
+	}
+
+	std::ostream & ansistream::context_stream() {
+		return context().out;
+	}
+
+	void ansistream::apply_sgr(std::string_view escape) {
+		if (merge_sgr)
+			return;
+		// The escapes passed here come from null-terminated tables or literals.
+		FORMICINE_PRINT_STYLE(escape.data());
+		output_state &current = state();
+		current.emitted = current.attributes;
+	}
+
+	void ansistream::sync_sgr() {
+		if (!merge_sgr)
+			return;
+
+		output_state &current = state();
+		if (current.attributes == current.emitted)
+			return;
+
+		std::array<char, 72> buffer;
+		const size_t length = build_sgr(current.emitted, current.attributes, buffer.data());
+		style_stream().write(buffer.data(), length);
+		current.emitted = current.attributes;
+	}
+
+	void ansistream::flush_point() {
+		// In concurrent mode, lines are written out as soon as they're complete.
+		if (writer)
+			return;
+
+		if (buffer) {
+			buffer->flush_point();
+			return;
+		}
+#ifndef FORMICINE_NOFLUSH
+		content_out.flush();
+		style_out.flush();
+#endif
+	}
+
 	ansistream & ansistream::left_paren() {
-		if (parens_on) {
+		if (state().parens_on) {
 			*this << style::dim;
+			sync_sgr();
 			FORMICINE_PRINT_CONTENT("(");
 			*this >> style::dim;
 		}
@@ -276,9 +957,11 @@ namespace ansi {
 	}
 
 	ansistream & ansistream::right_paren() {
-		if (parens_on) {
-			parens_on = false;
+		output_state &current = state();
+		if (current.parens_on) {
+			current.parens_on = false;
 			*this << style::dim;
+			sync_sgr();
 			FORMICINE_PRINT_CONTENT(")");
 			*this >> style::dim;
 		}
@@ -300,6 +983,13 @@ namespace ansi {
 
 
 	ansistream & ansistream::flush() {
+		if (writer) {
+			context().buffer.submit_all();
+			return *this;
+		}
+
+		if (buffer)
+			buffer->flush();
 #ifndef FORMICINE_NOFLUSH
 		content_out.flush();
 		style_out.flush();
@@ -307,7 +997,100 @@ namespace ansi {
 		return *this;
 	}
 
+	ansistream & ansistream::enable_buffering(int fd, flush_policy policy, size_t threshold) {
+		disable_buffering();
+		buffer = std::make_unique<write_buffer>(fd, policy, threshold);
+		buffered_out.rdbuf(buffer.get());
+		return *this;
+	}
+
+	ansistream & ansistream::enable_buffering(flush_policy policy, size_t threshold) {
+		disable_buffering();
+		buffer = std::make_unique<write_buffer>(content_out, policy, threshold);
+		buffered_out.rdbuf(buffer.get());
+		return *this;
+	}
+
+	ansistream & ansistream::disable_buffering() {
+		if (buffer) {
+			buffered_out.rdbuf(nullptr);
+			buffer.reset();
+		}
+
+		return *this;
+	}
+
+	ansistream & ansistream::enable_concurrency(int fd) {
+#ifdef FORMICINE_PRINTF
+		(void) fd;
+		throw std::runtime_error("Concurrent mode isn't supported when FORMICINE_PRINTF is defined");
+#else
+		disable_concurrency();
+		disable_buffering();
+		flush();
+		writer = std::make_shared<line_writer>(fd);
+		writer_id = next_writer_id++;
+		return *this;
+#endif
+	}
+
+	ansistream & ansistream::enable_concurrency() {
+#ifdef FORMICINE_PRINTF
+		throw std::runtime_error("Concurrent mode isn't supported when FORMICINE_PRINTF is defined");
+#else
+		disable_concurrency();
+		disable_buffering();
+		flush();
+		writer = std::make_shared<line_writer>(content_out);
+		writer_id = next_writer_id++;
+		return *this;
+#endif
+	}
+
+	ansistream & ansistream::disable_concurrency() {
+		if (writer) {
+			// Other threads' contexts can't be reached from here; they're dropped when those threads next look up a
+			// context or exit.
+			drop_context();
+			writer->stop();
+			writer.reset();
+			writer_id = 0;
+		}
+
+		return *this;
+	}
+
+	line_writer::stats ansistream::concurrency_stats() const {
+		return writer? writer->get_stats() : line_writer::stats {};
+	}
+
+	ansistream & ansistream::end_frame() {
+		if (buffer)
+			buffer->end_frame();
+		return *this;
+	}
+
+	ansistream & ansistream::enable_sgr_merging() {
+		merge_sgr = true;
+		return *this;
+	}
+
+	ansistream & ansistream::disable_sgr_merging() {
+		sync_sgr();
+		merge_sgr = false;
+		return *this;
+	}
+
+	const sgr_state & ansistream::get_attributes() {
+		return state().attributes;
+	}
+
+	write_buffer::stats ansistream::buffer_stats() const {
+		return buffer? buffer->get_stats() : write_buffer::stats {};
+	}
+
 	ansistream & ansistream::clear() {
+		sync_sgr();
 		FORMICINE_PRINT_STYLE("\e[2J");
 		return *this;
 	}
@@ -317,21 +1100,21 @@ namespace ansi {
 #ifdef FORMICINE_PRINTF
 			printf("\e[%d;%dH", y + 1, x + 1);
 #else
-			style_out << "\e[" << (y + 1) << ";" << (x + 1) << "H";
+			style_stream() << "\e[" << (y + 1) << ";" << (x + 1) << "H";
 #endif
 		} else if (0 <= x) {
 #ifdef FORMICINE_PRINTF
 			printf("\e[%dG", x + 1);
 #else
-			style_out << "\e[" << (x + 1) << "G";
+			style_stream() << "\e[" << (x + 1) << "G";
 #endif
 		} else if (0 <= y) {
 #ifdef FORMICINE_PRINTF
 			printf("\e[999999A");
 			if (0 < y) printf("\e[%dB", y);
 #else
-			style_out << "\e[999999A";
-			if (0 < y) style_out << "\e[" << y << "B";
+			style_stream() << "\e[999999A";
+			if (0 < y) style_stream() << "\e[" << y << "B";
 #endif
 		} else {
 			throw std::runtime_error("Invalid jump: (" + std::to_string(x) + ", " + std::to_string(y) + ")");
@@ -343,9 +1126,10 @@ namespace ansi {
 	ansistream & ansistream::jump()        { jump(0, 0);             return *this; }
 	ansistream & ansistream::save()        { FORMICINE_PRINT_STYLE("\e[s");    return *this; }
 	ansistream & ansistream::restore()     { FORMICINE_PRINT_STYLE("\e[u");    return *this; }
-	ansistream & ansistream::clear_line()  { FORMICINE_PRINT_STYLE("\e[2K");   return *this; }
-	ansistream & ansistream::clear_left()  { FORMICINE_PRINT_STYLE("\e[1K");   return *this; }
-	ansistream & ansistream::clear_right() { FORMICINE_PRINT_STYLE("\e[K");    return *this; }
+	// Erasing fills with the current background color, so pending attribute changes are written first.
+	ansistream & ansistream::clear_line()  { sync_sgr(); FORMICINE_PRINT_STYLE("\e[2K"); return *this; }
+	ansistream & ansistream::clear_left()  { sync_sgr(); FORMICINE_PRINT_STYLE("\e[1K"); return *this; }
+	ansistream & ansistream::clear_right() { sync_sgr(); FORMICINE_PRINT_STYLE("\e[K");  return *this; }
 
 	ansistream & ansistream::show() { FORMICINE_PRINT_STYLE("\e[?25h"); hidden = false; return *this; }
 	ansistream & ansistream::hide() { FORMICINE_PRINT_STYLE("\e[?25l"); hidden = true;  return *this; }
@@ -354,7 +1138,7 @@ namespace ansi {
 #ifdef FORMICINE_PRINTF
 		if (n != 0) printf("\e[%d%c", n, c);
 #else
-		if (n != 0) style_out << "\e[" << std::to_string(n) << c;
+		if (n != 0) style_stream() << "\e[" << std::to_string(n) << c;
 #endif
 		return *this;
 	}
@@ -375,34 +1159,37 @@ namespace ansi {
 #ifdef FORMICINE_PRINTF
 		printf("\e[%dH", x + 1);
 #else
-		style_out << "\e[" + std::to_string(x + 1) + "H";
+		style_stream() << "\e[" + std::to_string(x + 1) + "H";
 #endif
 		return *this;
 	}
 
 	ansistream & ansistream::scroll_up(int lines) {
+		sync_sgr();
 #ifdef FORMICINE_PRINTF
 		printf("\e[%dS", lines);
 #else
-		style_out << "\e[" + std::to_string(lines) + "S";
+		style_stream() << "\e[" + std::to_string(lines) + "S";
 #endif
 		return *this;
 	}
 
 	ansistream & ansistream::scroll_down(int lines) {
+		sync_sgr();
 #ifdef FORMICINE_PRINTF
 		printf("\e[%dT", lines);
 #else
-		style_out << "\e[" + std::to_string(lines) + "T";
+		style_stream() << "\e[" + std::to_string(lines) + "T";
 #endif
 		return *this;
 	}
 
 	ansistream & ansistream::delete_chars(int count) {
+		sync_sgr();
 #ifdef FORMICINE_PRINTF
 		printf("\e[%dP", count);
 #else
-		style_out << "\e[" + std::to_string(count) + "P";
+		style_stream() << "\e[" + std::to_string(count) + "P";
 #endif
 		return *this;
 	}
@@ -414,7 +1201,7 @@ namespace ansi {
 #ifdef FORMICINE_PRINTF
 		printf("\e[%d;%ds", left + 1, right + 1);
 #else
-		style_out << "\e[" + std::to_string(left + 1) + ";" + std::to_string(right + 1) + "s";
+		style_stream() << "\e[" + std::to_string(left + 1) + ";" + std::to_string(right + 1) + "s";
 #endif
 		return *this;
 	}
@@ -430,7 +1217,7 @@ namespace ansi {
 #ifdef FORMICINE_PRINTF
 		printf("\e[%s;%sr", top_str.c_str(), bottom_str.c_str());
 #else
-		style_out << "\e[" + top_str + ";" + bottom_str + "r";
+		style_stream() << "\e[" + top_str + ";" + bottom_str + "r";
 #endif
 		return *this;
 	}
@@ -447,7 +1234,12 @@ namespace ansi {
 		return *this;
 	}
 
-	ansistream & ansistream::reset_colors() { FORMICINE_PRINT_STYLE("\e[39;49m"); return *this; }
+	ansistream & ansistream::reset_colors() {
+		sgr_state &attributes = state().attributes;
+		attributes.fg = attributes.bg = color::normal;
+		apply_sgr("\e[39;49m");
+		return *this;
+	}
 
 
 // Public operators
@@ -455,8 +1247,8 @@ namespace ansi {
 
 	ansistream & ansistream::operator<<(const ansi::color &c) {
 		// Adds a text color: "as << red"
-		fg_color = c;
-		FORMICINE_PRINT_STYLE(get_fg(c).c_str());
+		state().attributes.fg = c;
+		apply_sgr(get_fg(c));
 		return *this;
 	}
 
@@ -466,17 +1258,29 @@ namespace ansi {
 		// - "as << bg(red)"
 
 		if (p.type == color_type::background)
-			FORMICINE_PRINT_STYLE(get_bg(bg_color = p.color).c_str());
+			apply_sgr(get_bg(state().attributes.bg = p.color));
 		else
-			FORMICINE_PRINT_STYLE(get_fg(fg_color = p.color).c_str());
+			apply_sgr(get_fg(state().attributes.fg = p.color));
 
 		return *this;
 	}
 
 	ansistream & ansistream::operator<<(const ansi::style &style) {
 		// Adds a style: "as << bold"
-		styles.insert(style);
-		FORMICINE_PRINT_STYLE(style_codes.at(style).c_str());
+		state().attributes.styles |= style_bit(style);
+		apply_sgr(style_codes[style]);
+		return *this;
+	}
+
+	ansistream & ansistream::operator<<(const ansi::sgr_state &sgr) {
+		// Sets all colors and styles at once with a single escape: "as << sgr_state {color::red}"
+		output_state &current = state();
+		current.attributes = sgr;
+		if (!merge_sgr && current.attributes != current.emitted) {
+			merge_sgr = true;
+			sync_sgr();
+			merge_sgr = false;
+		}
 		return *this;
 	}
 
@@ -490,45 +1294,58 @@ namespace ansi {
 	ansistream & ansistream::operator<<(const ansi::action &action) {
 		// Performs an action on the stream: "as << reset"
 		switch (action) {
-			case action::end_line:      *this << "\e[0m" << std::endl; break;
-			case action::reset:         *this << reset_all; break;
+			case action::end_line:
+				state().attributes = {};
+				if (merge_sgr) {
+					sync_sgr();
+					*this << std::endl;
+				} else {
+					*this << "\e[0m" << std::endl;
+					state().emitted = {};
+				}
+				break;
+			case action::reset:
+				state().attributes = {};
+				if (!merge_sgr) {
+					*this << reset_all;
+					state().emitted = {};
+				}
+				break;
 			case action::check:         *this << "["_d << wrap(str_check, color::green)  << "] "_d; break;
 			case action::nope:          *this << "["_d << wrap(str_nope,  color::red)    << "] "_d; break;
 			case action::warning:       *this << "["_d << wrap("~",       color::yellow) << "] "_d; break;
 			case action::information:   *this << "["_d << wrap("i",       color::blue)   << "] "_d; break;
 			case action::open_paren:    *this << wrap("(", style::dim); break;
 			case action::close_paren:   *this << wrap(")", style::dim); break;
-			case action::enable_parens: parens_on = true; break;
+			case action::enable_parens: state().parens_on = true; break;
 			default:
 				throw std::invalid_argument("Invalid action: " + std::to_string(static_cast<int>(action)));
 		}
 
-#ifndef FORMICINE_NOFLUSH
-		this->content_out.flush();
-		this->style_out.flush();
-#endif
+		flush_point();
 		return *this;
 	}
 
 	// These next three are for manipulator support.
 
 	ansistream & ansistream::operator<<(std::ostream & (*fn)(std::ostream &)) {
-		fn(content_out);
+		fn(content_stream());
 		return *this;
 	}
 
 	ansistream & ansistream::operator<<(std::ostream & (*fn)(std::ios &)) {
-		fn(content_out);
+		fn(content_stream());
 		return *this;
 	}
 
 	ansistream & ansistream::operator<<(std::ostream & (*fn)(std::ios_base &)) {
-		fn(content_out);
+		fn(content_stream());
 		return *this;
 	}
 
 	ansistream & ansistream::operator<<(const char *t) {
 		left_paren();
+		sync_sgr();
 		FORMICINE_PRINT_CONTENT(t);
 		right_paren();
 		return *this;
@@ -536,8 +1353,8 @@ namespace ansi {
 
 	ansistream & ansistream::operator>>(const ansi::style &style) {
 		// Removes a style: "as >> bold"
-		styles.erase(style);
-		FORMICINE_PRINT_STYLE(style_resets.at(style).c_str());
+		state().attributes.styles &= ~style_bit(style);
+		apply_sgr(style_resets[style]);
 		return *this;
 	}
 
@@ -548,74 +1365,12 @@ namespace ansi {
 	const std::string str_check   = "\u2714";
 	const std::string str_nope    = "\u2718";
 	const std::string str_warning = "\u26a0\ufe0f";
-
-	const std::map<color, std::string> color_names = {
-		{color::normal,    "normal"},
-		{color::red,       "red"},
-		{color::orange,    "orange"},
-		{color::yellow,    "yellow"},
-		{color::yeen,      "yeen"},
-		{color::green,     "green"},
-		{color::blue,      "blue"},
-		{color::cyan,      "cyan"},
-		{color::magenta,   "magenta"},
-		{color::purple,    "purple"},
-		{color::black,     "black"},
-		{color::gray,      "gray"},
-		{color::lightgray, "light gray"},
-		{color::white,     "white"},
-		{color::pink,      "pink"},
-		{color::sky,       "sky"},
-		{color::verydark,  "verydark"},
-		{color::blood,     "blood"},
-		{color::brown,     "brown"},
-	};
-
-	const std::map<color, std::string> color_bases = {
-		{color::normal,    "9"},
-		{color::red,       "1"},
-		{color::orange,    "8;5;202"},
-		{color::yellow,    "3"},
-		{color::yeen,      "8;5;112"},
-		{color::green,     "2"},
-		{color::blue,      "4"},
-		{color::cyan,      "6"},
-		{color::magenta,   "5"},
-		{color::purple,    "8;5;56"},
-		{color::black,     "0"},
-		{color::gray,      "8;5;8"},
-		{color::lightgray, "8;5;7"},
-		{color::white,     "7"},
-		{color::pink,      "8;5;219"},
-		{color::sky,       "8;5;153"},
-		{color::verydark,  "8;5;232"},
-		{color::blood,     "8;5;52"},
-		{color::brown,     "8;5;130"},
-	};
-
-	const std::map<style, std::string> style_codes = {
-		{style::bold,          "\e[1m"},
-		{style::dim,           "\e[2m"},
-		{style::italic,        "\e[3m"},
-		{style::underline,     "\e[4m"},
-		{style::inverse,       "\e[7m"},
-		{style::strikethrough, "\e[9m"},
-	};
-
-	const std::map<style, std::string> style_resets = {
-		{style::bold,          "\e[22m"},
-		{style::dim,           "\e[22m"},
-		{style::italic,        "\e[23m"},
-		{style::underline,     "\e[24m"},
-		{style::inverse,       "\e[27m"},
-		{style::strikethrough, "\e[29m"},
-	};
 }
 
-std::string operator"" _b(const char *str, unsigned long) { return ansi::wrap(str, ansi::style::bold); }
-std::string operator"" _d(const char *str, unsigned long) { return ansi::wrap(str, ansi::style::dim); }
-std::string operator"" _i(const char *str, unsigned long) { return ansi::wrap(str, ansi::style::italic); }
-std::string operator"" _u(const char *str, unsigned long) { return ansi::wrap(str, ansi::style::underline); }
-std::string operator"" _bd(const char *str, unsigned long) {
-	return ansi::wrap(ansi::wrap(str, ansi::style::bold), ansi::style::dim);
+std::string operator"" _b(const char *str, unsigned long len) { return ansi::wrap({str, len}, ansi::style::bold); }
+std::string operator"" _d(const char *str, unsigned long len) { return ansi::wrap({str, len}, ansi::style::dim); }
+std::string operator"" _i(const char *str, unsigned long len) { return ansi::wrap({str, len}, ansi::style::italic); }
+std::string operator"" _u(const char *str, unsigned long len) { return ansi::wrap({str, len}, ansi::style::underline); }
+std::string operator"" _bd(const char *str, unsigned long len) {
+	return ansi::wrap(ansi::wrap({str, len}, ansi::style::bold), ansi::style::dim);
 }
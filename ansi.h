@@ -1,12 +1,23 @@
 #ifndef FORMICINE_ANSI_H_
 #define FORMICINE_ANSI_H_
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
-#include <map>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
-#include <unordered_set>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 #ifdef NODEBUG
 #define DBGX(x)
@@ -30,8 +41,271 @@ namespace ansi {
 	enum class color_type: int {background = 1, foreground = 2, both = 3};
 	enum class action: int {reset, end_line, check, nope, warning, information, open_paren, close_paren, enable_parens};
 
+	constexpr size_t color_count = 19;
+	constexpr size_t style_count = 6;
+
+	/** A fixed-size array indexed by the values of an enum. */
+	template <typename E, typename T, size_t N>
+	struct enum_array {
+		std::array<T, N> values;
+
+		constexpr const T & operator[](E key) const { return values[static_cast<size_t>(key)]; }
+		constexpr const T & at(E key) const { return values.at(static_cast<size_t>(key)); }
+		constexpr size_t size() const { return N; }
+		constexpr auto begin() const { return values.begin(); }
+		constexpr auto end() const { return values.end(); }
+	};
+
+	/** A complete escape sequence stored inline. The unused bytes are zeroes, so data() is null-terminated. */
+	struct escape_code {
+		char data[12] {};
+		size_t length = 0;
+
+		constexpr escape_code() = default;
+		constexpr escape_code(std::string_view prefix, std::string_view base) {
+			for (const std::string_view piece: {prefix, base, std::string_view("m")})
+				for (const char ch: piece)
+					data[length++] = ch;
+		}
+
+		constexpr std::string_view view() const { return {data, length}; }
+		constexpr operator std::string_view() const { return view(); }
+	};
+
+	inline constexpr enum_array<color, std::string_view, color_count> color_names {{
+		"normal", "red", "orange", "yellow", "yeen", "green", "blue", "cyan", "magenta", "purple", "black", "gray",
+		"light gray", "white", "pink", "sky", "verydark", "blood", "brown"
+	}};
+
+	inline constexpr enum_array<color, std::string_view, color_count> color_bases {{
+		"9", "1", "8;5;202", "3", "8;5;112", "2", "4", "6", "5", "8;5;56", "0", "8;5;8", "8;5;7", "7", "8;5;219",
+		"8;5;153", "8;5;232", "8;5;52", "8;5;130"
+	}};
+
+	inline constexpr enum_array<style, std::string_view, style_count> style_codes {{
+		"\e[1m", "\e[2m", "\e[3m", "\e[4m", "\e[7m", "\e[9m"
+	}};
+
+	inline constexpr enum_array<style, std::string_view, style_count> style_resets {{
+		"\e[22m", "\e[22m", "\e[23m", "\e[24m", "\e[27m", "\e[29m"
+	}};
+
+	namespace detail {
+		/** Builds the table of escapes that set each color. Only the basic eight colors have bright variants. */
+		constexpr enum_array<color, escape_code, color_count> make_color_escapes(bool background, bool bright) {
+			enum_array<color, escape_code, color_count> out {};
+			for (size_t i = 0; i < color_count; ++i) {
+				const std::string_view base = color_bases.values[i];
+				if (bright && base.size() == 1)
+					out.values[i] = {background? "\e[10" : "\e[9", base};
+				else
+					out.values[i] = {background? "\e[4" : "\e[3", base};
+			}
+			return out;
+		}
+	}
+
+	inline constexpr auto fg_escapes        = detail::make_color_escapes(false, false);
+	inline constexpr auto bg_escapes        = detail::make_color_escapes(true,  false);
+	inline constexpr auto bright_fg_escapes = detail::make_color_escapes(false, true);
+	inline constexpr auto bright_bg_escapes = detail::make_color_escapes(true,  true);
+
+	/** Returns the escape that sets the foreground color. The result is null-terminated. */
+	constexpr std::string_view get_fg(ansi::color color, bool bright = false) {
+		return (bright? bright_fg_escapes : fg_escapes)[color];
+	}
+
+	/** Returns the escape that sets the background color. The result is null-terminated. */
+	constexpr std::string_view get_bg(ansi::color color, bool bright = false) {
+		return (bright? bright_bg_escapes : bg_escapes)[color];
+	}
+
+	namespace detail {
+		// Color names are looked up through a perfect hash of their length and first, middle and last characters. The
+		// seed is found at compile time by trying seeds until no two names share a slot.
+		constexpr size_t color_hash_size = 64;
+
+		constexpr size_t color_hash(std::string_view name, uint32_t seed) {
+			uint32_t hash = seed;
+			for (const uint32_t value: {static_cast<uint32_t>(name.size()), static_cast<uint32_t>(name.front()),
+			                            static_cast<uint32_t>(name[name.size() / 2]), static_cast<uint32_t>(name.back())})
+				hash = (hash ^ value) * 16777619u;
+			return (hash ^ (hash >> 16)) & (color_hash_size - 1);
+		}
+
+		constexpr uint32_t find_color_seed() {
+			for (uint32_t seed = 1; seed != 0; ++seed) {
+				std::array<bool, color_hash_size> used {};
+				bool collided = false;
+				for (const std::string_view name: color_names) {
+					bool &slot = used[color_hash(name, seed)];
+					if (slot) {
+						collided = true;
+						break;
+					}
+					slot = true;
+				}
+
+				if (!collided)
+					return seed;
+			}
+
+			throw std::logic_error("No perfect hash seed found for color names");
+		}
+
+		constexpr uint32_t color_seed = find_color_seed();
+
+		/** Maps hash slots to color indices. Empty slots hold -1. */
+		constexpr std::array<int8_t, color_hash_size> color_slots = [] {
+			std::array<int8_t, color_hash_size> slots {};
+			slots.fill(-1);
+			for (size_t i = 0; i < color_count; ++i)
+				slots[color_hash(color_names.values[i], color_seed)] = static_cast<int8_t>(i);
+			return slots;
+		}();
+	}
+
+	/** Finds the color with a given name. Returns std::nullopt if there's no such color. */
+	constexpr std::optional<color> find_color(std::string_view name) {
+		if (name.empty())
+			return std::nullopt;
+		const int8_t index = detail::color_slots[detail::color_hash(name, detail::color_seed)];
+		if (index < 0 || color_names.values[index] != name)
+			return std::nullopt;
+		return static_cast<color>(index);
+	}
+
+	/** Finds the color with a given name. Returns color::normal if there's no such color. */
+	constexpr ansi::color get_color(std::string_view name) {
+		return find_color(name).value_or(color::normal);
+	}
+
+	/** Returns whether there's a color with a given name. */
+	constexpr bool has_color(std::string_view name) {
+		return find_color(name).has_value();
+	}
+
 	/** Replaces escapes that start with '^' with ANSI escapes. */
-	std::string format(const std::string &str);
+	std::string format(std::string_view str);
+
+	/** A string literal that can be passed as a template argument. */
+	template <size_t N>
+	struct format_string {
+		char data[N] {};
+
+		constexpr format_string(const char (&str)[N]) {
+			for (size_t i = 0; i < N; ++i)
+				data[i] = str[i];
+		}
+
+		constexpr std::string_view view() const { return {data, N - 1}; }
+	};
+
+	namespace detail {
+		constexpr std::string_view format_reset_all = "\e[0m";
+		constexpr std::string_view format_reset_fg  = "\e[39m";
+		constexpr std::string_view format_reset_bg  = "\e[49m";
+
+		/** Expands a format string and passes each piece of the output to sink as a std::string_view. This can run in
+		 *  a constant expression; a malformed format string throws std::invalid_argument, which makes constant
+		 *  evaluation fail. */
+		template <typename Sink>
+		constexpr void expand_format(std::string_view str, Sink &&sink) {
+			const size_t length = str.length();
+			size_t i = 0;
+			while (i < length) {
+				const size_t caret = str.find('^', i);
+				// A '^' at the very end is copied as-is.
+				if (caret == std::string_view::npos || caret == length - 1) {
+					sink(str.substr(i));
+					return;
+				}
+
+				if (caret != i)
+					sink(str.substr(i, caret - i));
+
+				const size_t remaining = length - caret - 1;
+				i = caret + 2;
+
+				switch (str[caret + 1]) {
+					case '^': sink("^"); break;
+					case 'b': sink(style_codes[style::bold]);       break;
+					case 'd': sink(style_codes[style::dim]);        break;
+					case 'u': sink(style_codes[style::underline]);  break;
+					case 'i': sink(style_codes[style::italic]);     break;
+					case 'B': sink(style_resets[style::bold]);      break;
+					case 'D': sink(style_resets[style::dim]);       break;
+					case 'U': sink(style_resets[style::underline]); break;
+					case 'I': sink(style_resets[style::italic]);    break;
+					case '0': sink(format_reset_all); break;
+					case '[': {
+						if (remaining < 3)
+							throw std::invalid_argument("Invalid next character in format");
+
+						const size_t close_pos = str.find(']', caret + 3);
+						if (close_pos == std::string_view::npos)
+							throw std::invalid_argument("Invalid format identifier");
+
+						std::string_view type = str.substr(caret + 2, close_pos - (caret + 2));
+						i = close_pos + 1;
+
+						bool bright = false;
+						if (type.back() == '!') {
+							bright = true;
+							type.remove_suffix(1);
+						}
+
+						if (type == "/f") {
+							sink(format_reset_fg);
+							break;
+						}
+
+						if (type == "/b") {
+							sink(format_reset_bg);
+							break;
+						}
+
+						const bool background = !type.empty() && type.front() == ':';
+						if (background)
+							type.remove_prefix(1);
+
+						const std::optional<color> col = find_color(type);
+						if (!col)
+							throw std::invalid_argument("Invalid format identifier");
+
+						sink(background? get_bg(*col, bright) : get_fg(*col, bright));
+						break;
+					}
+					default:
+						throw std::invalid_argument("Invalid next character in format");
+				}
+			}
+		}
+
+		template <format_string S>
+		struct formatted {
+			static constexpr size_t length = [] {
+				size_t count = 0;
+				expand_format(S.view(), [&count](std::string_view piece) { count += piece.size(); });
+				return count;
+			}();
+
+			static constexpr std::array<char, length + 1> data = [] {
+				std::array<char, length + 1> out {};
+				size_t written = 0;
+				expand_format(S.view(), [&](std::string_view piece) {
+					for (const char ch: piece)
+						out[written++] = ch;
+				});
+				return out;
+			}();
+		};
+	}
+
+	/** Expands a format string at compile time. Malformed format strings are compile errors. The result is
+	 *  null-terminated. */
+	template <format_string S>
+	inline constexpr std::string_view static_format {detail::formatted<S>::data.data(), detail::formatted<S>::length};
 
 	template <typename T>
 	struct ansi_pair {
@@ -47,30 +321,211 @@ namespace ansi {
 		color_pair(ansi::color color, ansi::color_type type): color(color), type(type) {}
 		color_pair(ansi::color color): color(color), type(color_type::foreground) {}
 
-		std::string left() const;
-		std::string right() const;
+		std::string_view left() const;
+		std::string_view right() const;
+	};
+
+	/** Returns the bit that represents a style in a style bitmask. */
+	constexpr uint8_t style_bit(ansi::style style) {
+		return static_cast<uint8_t>(1 << static_cast<int>(style));
+	}
+
+	/** A set of SGR attributes: foreground and background colors and a bitmask of styles. */
+	struct sgr_state {
+		ansi::color fg = ansi::color::normal;
+		ansi::color bg = ansi::color::normal;
+		uint8_t styles = 0;
+
+		bool operator==(const sgr_state &) const = default;
+	};
+
+	/** Determines when a write_buffer writes out what it has collected. */
+	enum class flush_policy {
+		/** At every flush point: after each action and on std::endl or std::flush. */
+		immediate,
+		/** Whenever a newline is written. */
+		line,
+		/** Whenever the buffer holds at least a given number of bytes. */
+		bytes,
+		/** Whenever end_frame() is called on the ansistream. */
+		frame,
+		/** Only when flush() is called explicitly. */
+		never
+	};
+
+	/** A stream buffer that collects bytes in the order they're written and writes them out in one piece, either
+	 *  to a file descriptor with a single write(2) or to another ostream. */
+	class write_buffer: public std::streambuf {
+		public:
+			struct stats {
+				/** The number of times the buffer was written out. */
+				size_t flushes = 0;
+				/** The total number of bytes written out. */
+				size_t bytes = 0;
+			};
+
+			write_buffer(int fd, flush_policy, size_t threshold);
+			write_buffer(std::ostream &, flush_policy, size_t threshold);
+			~write_buffer() override;
+
+			/** Writes out everything in the buffer. */
+			void flush();
+			/** Flushes if the policy calls for flushing at flush points. */
+			void flush_point();
+			/** Flushes if the policy is flush_policy::frame. */
+			void end_frame();
+
+			const stats & get_stats() const { return counters; }
+			flush_policy get_policy() const { return policy; }
+
+		protected:
+			int_type overflow(int_type) override;
+			std::streamsize xsputn(const char *, std::streamsize) override;
+			int sync() override;
+
+		private:
+			std::string buffer;
+			int fd = -1;
+			std::ostream *target = nullptr;
+			flush_policy policy;
+			size_t threshold;
+			stats counters;
+
+			/** Flushes if the policy calls for it after a given chunk was appended. */
+			void appended(const char *, size_t);
+	};
+
+	/** Collects chunks of text from any number of threads and writes them out in batches on a background thread,
+	 *  either to a file descriptor with writev(2) or to an ostream that nothing else writes to. Chunks are never
+	 *  interleaved with each other, and submitting one takes no lock and never waits for I/O. */
+	class line_writer {
+		public:
+			struct stats {
+				/** The number of batches written out. */
+				size_t batches = 0;
+				/** The number of chunks written out. */
+				size_t chunks = 0;
+				/** The total number of bytes written out. */
+				size_t bytes = 0;
+			};
+
+			line_writer(int fd);
+			line_writer(std::ostream &);
+			~line_writer();
+
+			line_writer(const line_writer &) = delete;
+			line_writer & operator=(const line_writer &) = delete;
+
+			/** Queues a chunk to be written out. Chunks submitted after stop() are discarded. */
+			void submit(std::string &&);
+			/** Writes out everything that has been queued and stops the writer thread. */
+			void stop();
+			bool stopped() const { return stopping.load(std::memory_order_acquire); }
+			stats get_stats() const;
+
+		private:
+			struct node {
+				std::atomic<node *> next = nullptr;
+				std::string text;
+			};
+
+			/** An intrusive multi-producer, single-consumer queue (Vyukov's): producers exchange themselves into head
+			 *  and link the previous head to themselves, while the writer thread follows the links from tail. */
+			std::atomic<node *> head;
+			node *tail;
+			node stub;
+
+			int fd = -1;
+			std::ostream *target = nullptr;
+			/** Set by producers and cleared by the writer thread before it drains the queue. */
+			std::atomic<uint32_t> pending = 0;
+			std::atomic<bool> stopping = false;
+			std::atomic<size_t> batches = 0, chunks = 0, bytes = 0;
+			std::thread thread;
+
+			void push(node *);
+			node * pop();
+			void run();
+			/** Writes out every node in the queue and returns whether there were any. */
+			bool drain();
+			void write_out(node **, size_t);
 	};
 
 	class ansistream {
 		private:
-			ansi::color fg_color = ansi::color::normal;
-			ansi::color bg_color = ansi::color::normal;
-			std::unordered_set<ansi::style> styles;
-			bool parens_on = false;
+			struct output_state {
+				/** The colors and styles that have been requested. */
+				sgr_state attributes;
+				/** The colors and styles that have actually been written out. */
+				sgr_state emitted;
+				bool parens_on = false;
+			};
+
+			/** Everything that describes a thread's position in its output. In concurrent mode, each thread has its
+			 *  own copy and its own line buffer; defined in ansi.cpp. */
+			struct thread_context;
+
+			/** A thread's contexts, one per writer it has written through, and a cache of the one it used last;
+			 *  defined in ansi.cpp. */
+			struct context_registry;
+
+			/** The calling thread's registry, or null if it hasn't been created yet or has been destroyed. */
+			static thread_local context_registry *local_registry;
+			/** Whether the calling thread's registry has been destroyed, as happens before static destructors run. */
+			static thread_local bool registry_destroyed;
+
+			/** Stands in for the context of any thread whose registry has been destroyed, such as a thread writing
+			 *  from a static destructor. Created under exiting_mutex. */
+			std::unique_ptr<thread_context> exiting_context;
+			std::mutex exiting_mutex;
+
+			output_state shared_state;
+			/** Whether SGR changes are merged and written lazily. */
+			bool merge_sgr = false;
 			bool origin_on = false;
 			bool hidden = false;
 
+			/** When buffering is enabled, both content and styles are written to buffered_out. */
+			std::unique_ptr<write_buffer> buffer;
+			std::ostream buffered_out {nullptr};
+
+			/** When concurrent mode is enabled, each thread's complete lines are submitted to the writer. */
+			std::shared_ptr<line_writer> writer;
+			/** Identifies the current writer so that threads can find their contexts for it. */
+			uint64_t writer_id = 0;
+
+			/** Returns the calling thread's context for the current writer, creating it if necessary. */
+			thread_context & context();
+			/** Drops the calling thread's context for the current writer, submitting its partial line. */
+			void drop_context();
+			output_state & state();
+
 			ansistream & left_paren();
 			ansistream & right_paren();
 			ansistream & move(int, char);
 
+			std::ostream & context_stream();
+			std::ostream & content_stream() { return writer? context_stream() : buffer? buffered_out : content_out; }
+			std::ostream & style_stream()   { return writer? context_stream() : buffer? buffered_out : style_out; }
+
+			/** Writes an escape for a change to the attributes, unless SGR merging is enabled. */
+			void apply_sgr(std::string_view);
+			/** When SGR merging is enabled, writes a single escape that brings the emitted attributes in line with the
+			 *  requested ones. Called before anything that depends on the current attributes is written. */
+			void sync_sgr();
+
+			/** Called after each action. Flushes unless FORMICINE_NOFLUSH is defined or the buffer's policy says
+			 *  otherwise. */
+			void flush_point();
+
 		public:
 			std::ostream &content_out;
 			std::ostream &style_out;
 
 			ansistream();
-			ansistream(std::ostream &stream): content_out(stream), style_out(stream) {}
-			ansistream(std::ostream &c, std::ostream &s): content_out(c), style_out(s) {}
+			ansistream(std::ostream &stream);
+			ansistream(std::ostream &c, std::ostream &s);
+			~ansistream();
 
 			ansistream(const ansistream &) = delete;
 			ansistream(ansistream &&) = delete;
@@ -80,6 +535,41 @@ namespace ansi {
 
 			static ansistream & err();
 			ansistream & flush();
+
+			/** Starts collecting content and style output in a write-combining buffer that's written to a file
+			 *  descriptor with a single write(2) whenever the policy calls for it. Has no effect on output when
+			 *  FORMICINE_PRINTF is defined. */
+			ansistream & enable_buffering(int fd, flush_policy = flush_policy::line, size_t threshold = 4096);
+			/** Like enable_buffering(int, ...), but writes the buffer to the content stream. */
+			ansistream & enable_buffering(flush_policy = flush_policy::line, size_t threshold = 4096);
+			/** Flushes the buffer and goes back to writing directly to the content and style streams. */
+			ansistream & disable_buffering();
+			/** Marks the end of a frame. Flushes the buffer if its policy is flush_policy::frame. */
+			ansistream & end_frame();
+			/** Returns the number of flushes and bytes written by the buffer, or zeroes if buffering is disabled. */
+			write_buffer::stats buffer_stats() const;
+			/** Makes the stream safe to write to from multiple threads. Each thread gets its own line buffer and its
+			 *  own colors and styles; complete lines are queued and written to the file descriptor in batches by a
+			 *  background thread, so lines are never torn and writers never wait on the terminal. A partial line is
+			 *  held until it's completed, flush() is called or the thread exits. Enable this before starting the
+			 *  threads that share the stream. Supersedes buffering. */
+			ansistream & enable_concurrency(int fd);
+			/** Like enable_concurrency(int), but the background thread writes to the content stream, which nothing
+			 *  else may write to until concurrency is disabled. */
+			ansistream & enable_concurrency();
+			/** Writes out all queued lines and stops the background thread. Lines still held in other threads'
+			 *  buffers are lost. */
+			ansistream & disable_concurrency();
+			line_writer::stats concurrency_stats() const;
+
+			/** Makes color and style changes lazy: they're diffed against the attributes already in effect and
+			 *  written as one combined SGR escape just before the next content. Changes with no effect are skipped.
+			 *  Escapes embedded in content (like those from ansi::wrap) aren't tracked. */
+			ansistream & enable_sgr_merging();
+			/** Writes any pending SGR changes and goes back to writing each change immediately. */
+			ansistream & disable_sgr_merging();
+			/** Returns the colors and styles that have been requested. */
+			const sgr_state & get_attributes();
 			ansistream & clear();
 
 			/** Moves the cursor to a given position. Arguments are expected to be zero-based. */
@@ -152,6 +642,7 @@ namespace ansi {
 			ansistream & operator<<(const ansi::color_pair &);
 			ansistream & operator<<(const ansi::style &);
 			ansistream & operator<<(const ansi::ansi_pair<ansi::style> &);
+			ansistream & operator<<(const ansi::sgr_state &);
 			ansistream & operator<<(const ansi::action &);
 			ansistream & operator<<(std::ostream & (*fn)(std::ostream &));
 			ansistream & operator<<(std::ostream & (*fn)(std::ios &));
@@ -174,14 +665,16 @@ namespace ansi {
 			ansistream & operator<<(const std::_Setw &)   { return *this; }
 			template <typename T> ansistream & operator<<(const std::_Setfill<T> &) { return *this; }
 			ansistream & operator<<(const std::string &s) { printf("%s", s.c_str()); return *this; }
+			ansistream & operator<<(std::string_view s)   { printf("%.*s", int(s.size()), s.data()); return *this; }
 #else
-#define FORMICINE_PRINT_CONTENT(s) do { content_out << (s); } while (0)
-#define FORMICINE_PRINT_STYLE(s)   do { style_out   << (s); } while (0)
+#define FORMICINE_PRINT_CONTENT(s) do { content_stream() << (s); } while (0)
+#define FORMICINE_PRINT_STYLE(s)   do { style_stream()   << (s); } while (0)
 			template <typename T>
 			ansistream & operator<<(const T &value) {
 				// Piping miscellaneous values into the ansistream simply forwards them as-is to the content stream.
 				left_paren();
-				content_out << value;
+				sync_sgr();
+				content_stream() << value;
 				right_paren();
 				return *this;
 			}
@@ -200,46 +693,86 @@ namespace ansi {
 	static action cparen = action::close_paren;
 	static action parens = action::enable_parens;
 
-	std::string get_fg(ansi::color, bool bright = false);
-	std::string get_bg(ansi::color, bool bright = false);
 	color_pair fg(ansi::color color);
 	color_pair bg(ansi::color color);
 	ansi_pair<ansi::style> remove(ansi::style);
-	std::string wrap(const std::string &, const color_pair &);
-	std::string wrap(const std::string &, const color &);
-	std::string wrap(const std::string &, const style &);
+	std::string wrap(std::string_view, const color_pair &);
+	std::string wrap(std::string_view, const color &);
+	std::string wrap(std::string_view, const style &);
 	void write(std::ostream &, const std::string &);
 	void write(const std::string &);
 	std::string get_name(ansi::color);
-	ansi::color get_color(const std::string &);
-	bool has_color(const std::string &);
+
+	namespace detail {
+		/** Returns a pointer to the first '\x1b' in [begin, end) (or the first '^' too, if carets is true), or end if
+		 *  there isn't one. Uses AVX2 or SSE2 if the CPU supports them. */
+		const char * find_escape(const char *begin, const char *end, bool carets = false);
+
+		/** The implementations find_escape can choose from. */
+		enum class escape_kernel {scalar, sse2, avx2};
+
+		/** Returns the implementation find_escape is using. */
+		escape_kernel get_escape_kernel();
+
+		/** Makes find_escape use an implementation, for benchmarks and tests. Returns false and changes nothing if the
+		 *  CPU doesn't support it. */
+		bool set_escape_kernel(escape_kernel);
+
+		/** Given the offset of a '\x1b' (or a '^', if carets is true), returns the offset just past the escape it
+		 *  starts, or std::string::npos if scanning should stop there. */
+		size_t skip_escape(std::string_view, size_t, bool carets = false);
+
+		/** Calls fn(start, end) for each run of bytes in a string that aren't part of an ANSI escape (or a '^' escape,
+		 *  if carets is true). Scanning stops early if fn returns false. Returns the offset where scanning stopped. */
+		template <typename Fn>
+		size_t for_each_run(std::string_view str, bool carets, Fn &&fn) {
+			const char *data = str.data();
+			const size_t length = str.length();
+			size_t i = 0;
+			while (i < length) {
+				const size_t escape = find_escape(data + i, data + length, carets) - data;
+				if (i < escape && !fn(i, escape))
+					return escape;
+				if (escape == length)
+					return length;
+				i = skip_escape(str, escape, carets);
+				if (i == std::string::npos)
+					return escape;
+			}
+
+			return length;
+		}
+	}
 
 	/** Strips the ANSI escape sequences from a string. */
-	std::string strip(const std::string &);
+	std::string strip(std::string_view);
 
 	/** Finds a substring without ANSI escapes affecting the character count. */
-	std::string substr(const std::string &, size_t, size_t = std::string::npos);
+	std::string substr(std::string_view, size_t, size_t = std::string::npos);
 
 	/** Returns the length of a string without counting ANSI escapes. */
-	size_t length(const std::string &);
+	size_t length(std::string_view);
 
 	/** Boldens a string by wrapping it with the enable-bold and disable-bold escapes. */
-	std::string bold(const std::string &);
+	std::string bold(std::string_view);
 
 	/** Dims a string by wrapping it with the enable-dim and disable-dim escapes. */
-	std::string dim(const std::string &);
+	std::string dim(std::string_view);
 
 	/** Underlines a string by wrapping it with the enable-underline and disable-underline escapes. */
-	std::string underline(const std::string &);
+	std::string underline(std::string_view);
 
 	/** Italicizes a string by wrapping it with the enable-italics and disable-italics escapes. */
-	std::string italic(const std::string &);
+	std::string italic(std::string_view);
 
 	/** Erases part of a string (ANSI aware). */
 	std::string & erase(std::string &, size_t pos = 0, size_t len = std::string::npos);
 
 	/** Adjusts an index in a string to account for ANSI escapes. */
-	size_t get_pos(const std::string &, size_t);
+	size_t get_pos(std::string_view, size_t);
+
+	/** Adjusts two indices in a string to account for ANSI escapes, scanning the string only once. */
+	std::pair<size_t, size_t> get_pos_pair(std::string_view, size_t, size_t);
 
 	/** Inserts something into a string (ANSI aware). */
 	template <typename T>
@@ -247,7 +780,72 @@ namespace ansi {
 		return str.insert(get_pos(str, pos), obj);
 	}
 
-#define MKCOLOR(x) std::string x(const std::string &);
+	/** A string that keeps a table mapping visible columns to byte offsets, so that ANSI-aware position lookups take
+	 *  logarithmic time instead of rescanning the string. The table is updated incrementally when the string is
+	 *  edited through this class. */
+	class styled_string {
+		private:
+			/** A run of visible bytes. */
+			struct run {
+				size_t start;
+				size_t column;
+				size_t length;
+			};
+
+			std::string text;
+			std::vector<run> runs;
+			/** The offset at which scanning the string stopped. */
+			size_t stop = 0;
+
+			/** Rebuilds the entire index. */
+			void reindex();
+			/** Updates the index after the bytes in [pos, pos + removed) were replaced with inserted new bytes. */
+			void reindex(size_t pos, size_t removed, size_t inserted);
+
+		public:
+			styled_string() = default;
+			explicit styled_string(std::string);
+			explicit styled_string(const char *);
+
+			styled_string & operator=(std::string);
+
+			const std::string & str() const { return text; }
+			operator const std::string &() const { return text; }
+
+			/** Returns the length of the string in bytes. */
+			size_t size() const { return text.size(); }
+			/** Returns the length of the string without counting ANSI escapes. */
+			size_t length() const;
+
+			/** Adjusts an index to account for ANSI escapes. */
+			size_t get_pos(size_t) const;
+
+			/** Finds a substring without ANSI escapes affecting the character count. */
+			std::string substr(size_t, size_t = std::string::npos) const;
+
+			/** Inserts text at a visible position. */
+			styled_string & insert(size_t, std::string_view);
+			/** Inserts a character at a visible position. */
+			styled_string & insert(size_t, char);
+			/** Erases part of the string (ANSI aware). */
+			styled_string & erase(size_t pos = 0, size_t len = std::string::npos);
+			/** Appends text to the end of the string. */
+			styled_string & append(std::string_view);
+			styled_string & operator+=(std::string_view);
+	};
+
+	std::string strip(const styled_string &);
+	std::string substr(const styled_string &, size_t, size_t = std::string::npos);
+	size_t length(const styled_string &);
+	styled_string & erase(styled_string &, size_t pos = 0, size_t len = std::string::npos);
+	size_t get_pos(const styled_string &, size_t);
+
+	template <typename T>
+	styled_string & insert(styled_string &str, size_t pos, const T &obj) {
+		return str.insert(pos, obj);
+	}
+
+#define MKCOLOR(x) std::string x(std::string_view);
 	MKCOLOR(red)
 	MKCOLOR(orange)
 	MKCOLOR(yellow)
@@ -267,6 +865,88 @@ namespace ansi {
 	MKCOLOR(blood)
 #undef MKCOLOR
 
+	namespace detail {
+		template <typename OutputIt>
+		struct iterator_writer {
+			OutputIt out;
+			void operator()(std::string_view piece) { out = std::copy(piece.begin(), piece.end(), out); }
+			OutputIt result() { return out; }
+		};
+
+		struct string_writer {
+			std::string &out;
+			void operator()(std::string_view piece) { out += piece; }
+			std::string & result() { return out; }
+		};
+
+		struct span_writer {
+			std::span<char> out;
+			size_t written = 0;
+
+			void operator()(std::string_view piece) {
+				if (written < out.size())
+					piece.copy(out.data() + written, std::min(piece.size(), out.size() - written));
+				written += piece.size();
+			}
+
+			size_t result() { return written; }
+		};
+
+		template <std::output_iterator<char> OutputIt>
+		iterator_writer<OutputIt> make_writer(OutputIt out) { return {out}; }
+		inline string_writer make_writer(std::string &out) { return {out}; }
+		inline span_writer make_writer(std::span<char> out) { return {out}; }
+	}
+
+	// The *_to functions write their output to an output iterator, append it to a std::string or write it into a
+	// std::span<char>. They return the advanced iterator, the string, or the full length of the output respectively.
+	// Output that doesn't fit in a span is truncated. None of them allocate unless the destination itself has to grow.
+
+	/** Writes the result of format(str) to a destination. */
+	template <typename Out>
+	decltype(auto) format_to(Out &&out, std::string_view str) {
+		auto writer = detail::make_writer(std::forward<Out>(out));
+		detail::expand_format(str, writer);
+		return writer.result();
+	}
+
+	/** Writes the result of strip(str) to a destination. */
+	template <typename Out>
+	decltype(auto) strip_to(Out &&out, std::string_view str) {
+		auto writer = detail::make_writer(std::forward<Out>(out));
+		detail::for_each_run(str, true, [&](size_t start, size_t end) {
+			writer(str.substr(start, end - start));
+			return true;
+		});
+		return writer.result();
+	}
+
+	/** Writes the result of wrap(str, pair) to a destination. */
+	template <typename Out>
+	decltype(auto) wrap_to(Out &&out, std::string_view str, const color_pair &pair) {
+		auto writer = detail::make_writer(std::forward<Out>(out));
+		writer(pair.left());
+		writer(str);
+		writer(pair.right());
+		return writer.result();
+	}
+
+	/** Writes the result of wrap(str, color) to a destination. */
+	template <typename Out>
+	decltype(auto) wrap_to(Out &&out, std::string_view str, const color &color) {
+		return wrap_to(std::forward<Out>(out), str, color_pair(color));
+	}
+
+	/** Writes the result of wrap(str, style) to a destination. */
+	template <typename Out>
+	decltype(auto) wrap_to(Out &&out, std::string_view str, const style &style) {
+		auto writer = detail::make_writer(std::forward<Out>(out));
+		writer(style_codes[style]);
+		writer(str);
+		writer(style_resets[style]);
+		return writer.result();
+	}
+
 	const extern std::string reset_all;
 	const extern std::string reset_fg;
 	const extern std::string reset_bg;
@@ -275,11 +955,6 @@ namespace ansi {
 	const extern std::string str_nope;
 	const extern std::string str_warning;
 
-	const extern std::map<color, std::string> color_names;
-	const extern std::map<color, std::string> color_bases;
-	const extern std::map<style, std::string> style_codes;
-	const extern std::map<style, std::string> style_resets;
-
 	extern std::ofstream dbgout;
 	extern ansistream dbgstream;
 }
@@ -290,6 +965,12 @@ std::string operator"" _i(const char *str, unsigned long);
 std::string operator"" _u(const char *str, unsigned long);
 std::string operator"" _bd(const char *str, unsigned long);
 
+/** Expands a format string at compile time: "^b^[red]Error:^0"_fmt */
+template <ansi::format_string S>
+constexpr std::string_view operator"" _fmt() {
+	return ansi::static_format<S>;
+}
+
 #pragma GCC diagnostic pop
 
 #endif
@@ -0,0 +1,89 @@
+// Compares the scalar, SSE2 and AVX2 escape scanners on long, mostly plain lines. Run with make bench.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "ansi.h"
+
+namespace {
+	volatile size_t sink = 0;
+
+	/** Returns a line of the given length with a color escape every `spacing` bytes, or none if spacing is 0. */
+	std::string make_line(size_t length, size_t spacing) {
+		std::string line;
+		line.reserve(length);
+		while (line.size() < length) {
+			if (spacing != 0 && line.size() % spacing == 0)
+				line += line.size() % (2 * spacing) == 0? "\e[31m" : "\e[39m";
+			else
+				line += static_cast<char>('a' + line.size() % 26);
+		}
+		return line;
+	}
+
+	/** Runs fn on the line repeatedly for about a tenth of a second and returns the throughput in GB/s. */
+	template <typename Fn>
+	double measure(const std::string &line, Fn &&fn) {
+		using clock = std::chrono::steady_clock;
+		const auto start = clock::now();
+		size_t bytes = 0;
+		auto now = start;
+		do {
+			for (int i = 0; i < 64; ++i) {
+				sink = sink + fn(line);
+				bytes += line.size();
+			}
+			now = clock::now();
+		} while (now - start < std::chrono::milliseconds(100));
+		return bytes / std::chrono::duration<double, std::nano>(now - start).count();
+	}
+}
+
+int main() {
+	struct kernel_info {
+		ansi::detail::escape_kernel kernel;
+		const char *name;
+	};
+
+	const kernel_info kernels[] = {
+		{ansi::detail::escape_kernel::scalar, "scalar"},
+		{ansi::detail::escape_kernel::sse2,   "sse2"},
+		{ansi::detail::escape_kernel::avx2,   "avx2"},
+	};
+
+	struct line_info {
+		std::string line;
+		const char *name;
+	};
+
+	const std::vector<line_info> lines = {
+		{make_line(4096, 0),   "4 KB plain"},
+		{make_line(4096, 512), "4 KB, escape every 512 B"},
+		{make_line(1 << 20, 4096), "1 MB, escape every 4 KB"},
+	};
+
+	std::string out;
+	out.reserve((1 << 20) + 1);
+
+	std::printf("%-26s %-8s %10s %10s %10s\n", "line", "kernel", "strip", "length", "get_pos");
+	for (const line_info &info: lines) {
+		for (const kernel_info &kernel: kernels) {
+			if (!ansi::detail::set_escape_kernel(kernel.kernel)) {
+				std::printf("%-26s %-8s %32s\n", info.name, kernel.name, "(unsupported)");
+				continue;
+			}
+
+			const double strip = measure(info.line, [&](const std::string &line) {
+				out.clear();
+				return ansi::strip_to(out, line).size();
+			});
+			const double length = measure(info.line, [](const std::string &line) { return ansi::length(line); });
+			const double get_pos = measure(info.line, [](const std::string &line) {
+				return ansi::get_pos(line, line.size() / 2);
+			});
+			std::printf("%-26s %-8s %5.2f GB/s %5.2f GB/s %5.2f GB/s\n", info.name, kernel.name, strip, length, get_pos);
+		}
+	}
+}
@@ -1,6 +1,54 @@
+#include <cctype>
+#include <charconv>
+#include <span>
+
 #include "futil.h"
 
 namespace formicine::util {
+	namespace {
+		/** The character references that html_stripper decodes by name. */
+		constexpr std::pair<std::string_view, uint32_t> named_entities[] = {
+			{"amp", '&'}, {"lt", '<'}, {"gt", '>'}, {"quot", '"'}, {"apos", '\''}, {"nbsp", 0xa0}, {"copy", 0xa9},
+			{"reg", 0xae}, {"deg", 0xb0}, {"middot", 0xb7}, {"laquo", 0xab}, {"raquo", 0xbb}, {"times", 0xd7},
+			{"ndash", 0x2013}, {"mdash", 0x2014}, {"lsquo", 0x2018}, {"rsquo", 0x2019}, {"ldquo", 0x201c},
+			{"rdquo", 0x201d}, {"bull", 0x2022}, {"hellip", 0x2026}, {"euro", 0x20ac}, {"trade", 0x2122},
+		};
+
+		/** Finds the n-th word of a string without scanning past it. Returns {npos, npos} if there isn't one. */
+		word_index::span find_word(std::string_view str, size_t n) {
+			word_index::span word = word_index::next_word(str);
+			for (; word.start != std::string_view::npos && n != 0; --n)
+				word = word_index::next_word(str, word.end);
+			return word;
+		}
+
+		bool is_letter(char ch) {
+			return ('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z');
+		}
+
+		/** Appends a code point as UTF-8. Null characters, surrogates and values past U+10FFFF become U+FFFD. */
+		void append_utf8(std::string &out, uint64_t code) {
+			if (code == 0 || (0xd800 <= code && code <= 0xdfff) || 0x10ffff < code)
+				code = 0xfffd;
+
+			if (code < 0x80) {
+				out += static_cast<char>(code);
+			} else if (code < 0x800) {
+				out += static_cast<char>(0xc0 | code >> 6);
+				out += static_cast<char>(0x80 | (code & 0x3f));
+			} else if (code < 0x10000) {
+				out += static_cast<char>(0xe0 | code >> 12);
+				out += static_cast<char>(0x80 | (code >> 6 & 0x3f));
+				out += static_cast<char>(0x80 | (code & 0x3f));
+			} else {
+				out += static_cast<char>(0xf0 | code >> 18);
+				out += static_cast<char>(0x80 | (code >> 12 & 0x3f));
+				out += static_cast<char>(0x80 | (code >> 6 & 0x3f));
+				out += static_cast<char>(0x80 | (code & 0x3f));
+			}
+		}
+	}
+
 	std::string filter(const std::string &str, const std::string &allowed_chars) {
 		return filter(str, [&](char ch) { return allowed_chars.find(ch) != std::string::npos; });
 	}
@@ -30,45 +78,20 @@ namespace formicine::util {
 	}
 
 	std::string nth_word(const std::string &str, size_t n, bool condense) {
-		if (condense) {
-			const std::vector<std::string> words = split(str, " ", true);
-			return n < words.size()? words[n] : "";
+		for (const std::string_view word: split_view(str, ' ', condense)) {
+			if (n-- == 0)
+				return std::string(word);
 		}
 
-		if (n == 0)
-			return str.substr(0, str.find(' '));
-
-		const size_t index = nth_index(str, ' ', n);
-		if (index == std::string::npos)
-			return "";
-		return str.substr(index + 1, nth_index(str, ' ', n + 1) - index - 1);
+		return "";
 	}
 
 	size_t word_count(const std::string &str, bool condense) {
-		size_t count = 0, i = 0, length = str.length();
-		if (length == 0)
-			return 0;
-
-		// If condense is true, count all spaces except the ones at the beginning, then count and subtract the ones at
-		// the end.
-
-		if (condense) {
-			for (; i < length && str[i] == ' '; ++i);
-			if (i == length)
-				return 0;
-		}
-
-		for (; i < length; ++i) {
-			if (str[i] == ' ' && (!condense || i == 0 || str[i - 1] != ' '))
-				++count;
-		}
-
-		if (condense) {
-			for (i = length - 1; 0 <= static_cast<long>(i) && str[i] == ' '; --i)
-				--count;
-		}
-
-		return count + 1;
+		const split_view words(str, ' ', condense);
+		if (!condense)
+			return std::distance(words.begin(), words.end());
+		// The first token is kept even if the string starts with a space, so count only the nonempty ones.
+		return std::count_if(words.begin(), words.end(), [](std::string_view word) { return !word.empty(); });
 	}
 
 	std::string & trim(std::string &str) {
@@ -116,75 +139,97 @@ namespace formicine::util {
 		return rtrim(copy);
 	}
 
-	std::pair<ssize_t, ssize_t> word_indices(const std::string &str, size_t cursor) {
-		const size_t length = str.length();
-
-		ssize_t word_index = -1;
-		ssize_t sub_index  = -1;
-		char prev_char = '\0';
+	word_index::word_index(std::string_view str): length(str.size()) {
+		scan(str, 0, str.size(), spans);
+	}
 
-		if (str.empty())
-			return {-1, -1};
+	word_index::span word_index::next_word(std::string_view str, size_t from, size_t to) {
+		to = std::min(to, str.size());
+		const size_t start = from < to? str.find_first_not_of(' ', from) : std::string_view::npos;
+		if (start == std::string_view::npos || to <= start)
+			return {std::string_view::npos, std::string_view::npos};
+		return {start, std::min(str.find(' ', start), to)};
+	}
 
-		if (cursor == 0)
-			return str[0] == ' '? std::pair(-1, -1) : std::pair(0, 0);
+	void word_index::scan(std::string_view str, size_t from, size_t to, std::vector<span> &out) {
+		for (span word = next_word(str, from, to); word.start != std::string_view::npos;
+		     word = next_word(str, word.end, to))
+			out.push_back(word);
+	}
 
-		for (size_t i = 0; i < length; ++i) {
-			char ch = str[i];
+	std::string_view word_index::word(std::string_view str, size_t n) const {
+		return n < spans.size()? str.substr(spans[n].start, spans[n].length()) : std::string_view();
+	}
 
-			if (ch != ' ' && (prev_char == '\0' || prev_char == ' ')) {
-				++word_index;
-				sub_index = 0;
-			}
+	std::pair<ssize_t, ssize_t> word_index::locate(size_t cursor) const {
+		// The first word that doesn't end before the cursor either contains it, ends at it, or comes after it.
+		const auto found = std::lower_bound(spans.begin(), spans.end(), cursor, [](const span &word, size_t pos) {
+			return word.end < pos;
+		});
+		const ssize_t before = found - spans.begin();
+		if (found != spans.end() && found->start <= cursor)
+			return {before, cursor - found->start};
+		// If the cursor isn't in a word, -1 means it's before the first word, -2 before the second and so on.
+		return {-before - 1, -1};
+	}
 
-			if (ch == ' ') {
-				if (prev_char != ' ') {
-					// We've reached the end of a word. If this is where the cursor is, we're done.
-					// Otherwise, it's time to increment the word index.
-					if (i == cursor)
-						return {word_index, sub_index};
-				} else if (i == cursor) {
-					// If we're within a group of spaces and this is the where the cursor is, return a negative number
-					// because that means the cursor isn't in a word.
-					return {-word_index - 2, -1};
-				}
-			} else {
-				if (i == cursor)
-					return {word_index, sub_index};
+	ssize_t word_index::replace_word(std::string &str, size_t n, std::string_view replacement) {
+		if (spans.size() <= n)
+			return -1;
 
-				++sub_index;
-			}
+		const span replaced = spans[n];
+		str.replace(replaced.start, replaced.length(), replacement);
+		update(str, replaced.start, replaced.length(), replacement.size());
+		return replaced.start + replacement.size();
+	}
 
-			prev_char = ch;
+	void word_index::update(std::string_view str, size_t pos, size_t erased, size_t inserted) {
+		// Words touching the edited range can change: inserted spaces can split them, and deleted spaces can join them
+		// with their neighbors. Rescanning from the first to the last of them finds every word that changed.
+		auto first = std::lower_bound(spans.begin(), spans.end(), pos, [](const span &word, size_t at) {
+			return word.end < at;
+		});
+		auto last = std::upper_bound(first, spans.end(), pos + erased, [](size_t at, const span &word) {
+			return at < word.start;
+		});
+
+		const ssize_t shift = static_cast<ssize_t>(inserted) - static_cast<ssize_t>(erased);
+		const size_t from = first == last? pos : std::min(pos, first->start);
+		const size_t to = first == last? pos + inserted : std::max<ssize_t>(pos + inserted, (last - 1)->end + shift);
+
+		for (auto iter = last; iter != spans.end(); ++iter) {
+			iter->start += shift;
+			iter->end += shift;
 		}
 
-		if (cursor == length && prev_char != ' ')
-			return {word_index, sub_index};
-
-		return {-word_index - 2, -1};
+		std::vector<span> rescanned;
+		scan(str, from, to, rescanned);
+		const size_t index = first - spans.begin();
+		spans.erase(first, last);
+		spans.insert(spans.begin() + index, rescanned.begin(), rescanned.end());
+		length = str.size();
 	}
 
-	size_t index_of_word(const std::string &str, size_t n) {
-		const size_t length = str.length();
-		size_t word_index = 0;
-
-		char prev_char = '\0';
-		for (size_t i = 0; i < length; ++i) {
-			char ch = str[i];
+	// The free functions answer a single question, so rather than building a word_index they step through the words
+	// with word_index::next_word() only as far as the word or cursor they're looking for.
 
-			if (ch == ' ' && (prev_char != ' ' && prev_char != '\0')) {
-				// We're at a space and the previous character wasn't a space (or the beginning of the string).
-				// This means we've just left a word, so increment the word index.
-				++word_index;
-			}
-
-			if (ch != ' ' && (prev_char == ' ' || prev_char == '\0') && word_index == n)
-				return i;
-
-			prev_char = ch;
+	std::pair<ssize_t, ssize_t> word_indices(const std::string &str, size_t cursor) {
+		// Words that start after the cursor can't contain it, so the scan stops there. A word that reaches the cursor
+		// is cut off just past it, which is still enough to tell that the cursor is in it.
+		const size_t limit = cursor < str.size()? cursor + 1 : str.size();
+		ssize_t before = 0;
+		for (word_index::span word = word_index::next_word(str, 0, limit); word.start != std::string::npos;
+		     word = word_index::next_word(str, word.end, limit), ++before) {
+			if (cursor <= word.end)
+				return {before, cursor - word.start};
 		}
 
-		return length;
+		return {-before - 1, -1};
+	}
+
+	size_t index_of_word(const std::string &str, size_t n) {
+		const size_t start = find_word(str, n).start;
+		return start == std::string::npos? str.size() : start;
 	}
 
 	std::string skip_words(const std::string &str, size_t n) {
@@ -192,41 +237,16 @@ namespace formicine::util {
 	}
 
 	size_t last_index_of_word(const std::string &str, size_t n) {
-		const size_t length = str.length();
-		size_t word_index = 0;
-
-		char prev_char = '\0';
-		for (size_t i = 0; i < length; ++i) {
-			char ch = str[i];
-
-			if (ch == ' ' && (prev_char != ' ' && prev_char != '\0')) {
-				// We're at a space and the previous character wasn't a space (or the beginning of the string).
-				// This means we've just left a word, so check whether we're at the requested word index.
-				if (word_index++ == n)
-					return i;
-			}
-
-			prev_char = ch;
-		}
-
-		return length;
+		const size_t end = find_word(str, n).end;
+		return end == std::string::npos? str.size() : end;
 	}
 
 	ssize_t replace_word(std::string &str, size_t n, const std::string &word) {
-		const size_t index = index_of_word(str, n);
-		const size_t original_length = str.length();
-		if (index == original_length)
+		const word_index::span found = find_word(str, n);
+		if (found.start == std::string::npos)
 			return -1;
-
-		size_t original_word_width = 0;
-		for (size_t i = index; i < original_length; ++i) {
-			if (std::isspace(str[i]))
-				break;
-			++original_word_width;
-		}
-
-		str.replace(index, original_word_width, word);
-		return index + word.length();
+		str.replace(found.start, found.length(), word);
+		return found.start + word.size();
 	}
 
 	std::string & remove_suffix(std::string &word, const std::string &suffix) {
@@ -259,24 +279,401 @@ namespace formicine::util {
 	}
 
 	std::string replace_all(std::string str, const std::string &to_replace, const std::string &replace_with) {
-		const size_t replaced_length = to_replace.length();
-		size_t pos;
-		while ((pos = str.find(to_replace)) != std::string::npos)
-			str.replace(pos, replaced_length, replace_with);
-		return str;
+		if (to_replace.empty())
+			return str;
+
+		size_t pos = str.find(to_replace);
+		if (pos == std::string::npos)
+			return str;
+
+		std::string out;
+		out.reserve(str.size());
+		size_t last = 0;
+		for (; pos != std::string::npos; pos = str.find(to_replace, last)) {
+			out.append(str, last, pos - last).append(replace_with);
+			last = pos + to_replace.length();
+		}
+
+		out.append(str, last);
+		return out;
 	}
 
-	std::string remove_html(std::string str) {
-		for (size_t open = str.find('<'); open != std::string::npos; open = str.find('<')) {
-			const size_t close = str.find('>', open);
-			if (close == std::string::npos) {
-				// No closing angle bracket? Give up.
-				return str;
+	replacer::replacer(const std::map<std::string, std::string> &replacements) {
+		for (const auto &[pattern, replacement]: replacements)
+			add(pattern, replacement);
+		build();
+	}
+
+	replacer::replacer(std::initializer_list<std::pair<std::string, std::string>> replacements) {
+		for (const auto &[pattern, replacement]: replacements)
+			add(pattern, replacement);
+		build();
+	}
+
+	void replacer::add(const std::string &pattern, const std::string &replacement) {
+		if (pattern.empty())
+			return;
+
+		if (transitions.empty()) {
+			transitions.assign(256, no_match);
+			depths.push_back(0);
+			matches.push_back(no_match);
+		}
+
+		// Until build() fills them in, missing transitions in the trie are no_match.
+		uint32_t state = 0;
+		for (const unsigned char ch: pattern) {
+			uint32_t &next = transitions[state * 256 + ch];
+			if (next == no_match) {
+				next = depths.size();
+				transitions.resize(transitions.size() + 256, no_match);
+				depths.push_back(depths[state] + 1);
+				matches.push_back(no_match);
 			}
+			state = transitions[state * 256 + ch];
+		}
 
-			str.erase(open, close - open + 1);
+		if (matches[state] == no_match) {
+			matches[state] = patterns.size();
+			patterns.push_back(pattern);
+			replacement_strings.push_back(replacement);
+		} else {
+			replacement_strings[matches[state]] = replacement;
 		}
+	}
 
-		return str;
+	void replacer::build() {
+		if (transitions.empty())
+			return;
+
+		// A breadth-first pass computes each state's failure link and turns the trie into a complete automaton:
+		// a missing transition goes where the failure link's transition goes. A state that isn't the end of a
+		// pattern inherits the longest match of its failure link.
+		std::vector<uint32_t> fail(depths.size(), 0), queue;
+		queue.reserve(depths.size());
+		for (uint32_t &next: std::span(transitions.data(), 256)) {
+			if (next == no_match) {
+				next = 0;
+			} else {
+				queue.push_back(next);
+			}
+		}
+
+		for (size_t i = 0; i < queue.size(); ++i) {
+			const uint32_t state = queue[i];
+			if (matches[state] == no_match)
+				matches[state] = matches[fail[state]];
+			for (size_t ch = 0; ch < 256; ++ch) {
+				uint32_t &next = transitions[state * 256 + ch];
+				const uint32_t fallback = transitions[fail[state] * 256 + ch];
+				if (next == no_match) {
+					next = fallback;
+				} else {
+					fail[next] = fallback;
+					queue.push_back(next);
+				}
+			}
+		}
+	}
+
+	std::string replacer::operator()(std::string_view str) const {
+		if (transitions.empty())
+			return std::string(str);
+
+		std::string out;
+		out.reserve(str.size());
+
+		// The best match so far is only committed once no match still in progress could start at or before it,
+		// i.e. once the current state's string starts after it. Scanning then resumes from the end of the match,
+		// so text is only ever rescanned within a pattern's length of a match.
+		size_t emitted = 0, best_start = 0;
+		uint32_t best = no_match, state = 0;
+		for (size_t i = 0; i <= str.size(); ++i) {
+			if (i < str.size()) {
+				state = transitions[state * 256 + static_cast<unsigned char>(str[i])];
+				const uint32_t match = matches[state];
+				if (match != no_match) {
+					const size_t start = i + 1 - patterns[match].size();
+					if (best == no_match || start < best_start || (start == best_start &&
+					    patterns[best].size() < patterns[match].size())) {
+						best = match;
+						best_start = start;
+					}
+				}
+			}
+
+			if (best != no_match && (i == str.size() || best_start < i + 1 - depths[state])) {
+				out.append(str.substr(emitted, best_start - emitted)).append(replacement_strings[best]);
+				emitted = best_start + patterns[best].size();
+				best = no_match;
+				state = 0;
+				// The loop's increment brings i to emitted.
+				i = emitted - 1;
+			}
+		}
+
+		out.append(str.substr(emitted));
+		return out;
+	}
+
+	std::string replace_all(std::string_view str, const std::map<std::string, std::string> &replacements) {
+		return replacer(replacements)(str);
+	}
+
+	html_stripper::html_stripper(bool decode_entities_): decode_entities(decode_entities_) {}
+
+	void html_stripper::feed(std::string_view chunk, std::string &out) {
+		// Each state either consumes characters or switches to a state that reprocesses the current one.
+		size_t i = 0;
+		while (i < chunk.size()) {
+			const char ch = chunk[i];
+			switch (current) {
+				case state::text: {
+					const size_t next = chunk.find_first_of(decode_entities? "<&" : "<", i);
+					if (next == std::string_view::npos) {
+						out.append(chunk.substr(i));
+						return;
+					}
+					out.append(chunk.substr(i, next - i));
+					current = chunk[next] == '<'? state::tag_open : state::entity;
+					entity.clear();
+					i = next + 1;
+					break;
+				}
+
+				case state::tag_open:
+					if (is_letter(ch)) {
+						current = state::tag_name;
+						closing = false;
+						name.clear();
+					} else if (ch == '/' || ch == '!' || ch == '?') {
+						current = ch == '/'? state::end_tag_open : ch == '!'? state::declaration : state::bogus;
+						declaration.clear();
+						++i;
+					} else {
+						out += '<';
+						current = state::text;
+					}
+					break;
+
+				case state::end_tag_open:
+					if (is_letter(ch)) {
+						current = state::tag_name;
+						closing = true;
+						name.clear();
+					} else {
+						// "</>" is ignored, and anything else that isn't an end tag is treated like a comment.
+						current = ch == '>'? state::text : state::bogus;
+						++i;
+					}
+					break;
+
+				case state::tag_name:
+					if (ch == '>') {
+						close_tag();
+					} else if (std::isspace(static_cast<unsigned char>(ch)) || ch == '/') {
+						current = state::attributes;
+					} else if (name.size() < max_name) {
+						name += std::tolower(static_cast<unsigned char>(ch));
+					}
+					++i;
+					break;
+
+				case state::attributes: {
+					const size_t next = chunk.find_first_of("\"'>", i);
+					if (next == std::string_view::npos)
+						return;
+					if (chunk[next] == '>') {
+						close_tag();
+					} else {
+						quote = chunk[next];
+						current = state::quoted;
+					}
+					i = next + 1;
+					break;
+				}
+
+				case state::quoted: {
+					const size_t next = chunk.find(quote, i);
+					if (next == std::string_view::npos)
+						return;
+					current = state::attributes;
+					i = next + 1;
+					break;
+				}
+
+				case state::declaration:
+					declaration += ch;
+					++i;
+					if (declaration == "--") {
+						current = state::comment;
+						run = 0;
+					} else if (declaration == "[CDATA[") {
+						current = state::cdata;
+						run = 0;
+					} else if (!std::string_view("--").starts_with(declaration) &&
+					           !std::string_view("[CDATA[").starts_with(declaration)) {
+						current = ch == '>'? state::text : state::bogus;
+					}
+					break;
+
+				case state::comment:
+					if (ch == '>' && 2 <= run)
+						current = state::text;
+					run = ch == '-'? run + 1 : 0;
+					++i;
+					break;
+
+				case state::cdata:
+					if (run == 0 && ch != ']') {
+						const size_t next = chunk.find(']', i);
+						out.append(chunk.substr(i, next == std::string_view::npos? next : next - i));
+						i = next == std::string_view::npos? chunk.size() : next;
+						break;
+					}
+					if (ch == ']') {
+						// Only the last two of a run of brackets might begin the end of the section.
+						if (++run == 3) {
+							out += ']';
+							run = 2;
+						}
+					} else if (ch == '>' && run == 2) {
+						current = state::text;
+						run = 0;
+					} else {
+						out.append(run, ']');
+						out += ch;
+						run = 0;
+					}
+					++i;
+					break;
+
+				case state::bogus: {
+					const size_t next = chunk.find('>', i);
+					if (next == std::string_view::npos)
+						return;
+					current = state::text;
+					i = next + 1;
+					break;
+				}
+
+				case state::raw_text:
+					// Looks for "</" followed by the element's name and then a character that can end a tag name.
+					if (raw_matched == 0) {
+						const size_t next = chunk.find('<', i);
+						if (next == std::string_view::npos)
+							return;
+						raw_matched = 1;
+						i = next + 1;
+					} else if (raw_matched < raw_name.size() + 2) {
+						const char expected = raw_matched == 1? '/' : raw_name[raw_matched - 2];
+						if (std::tolower(static_cast<unsigned char>(ch)) == expected) {
+							++raw_matched;
+							++i;
+						} else {
+							raw_matched = 0;
+						}
+					} else {
+						if (std::isspace(static_cast<unsigned char>(ch)) || ch == '/' || ch == '>') {
+							current = state::attributes;
+							closing = true;
+							name = raw_name;
+						}
+						raw_matched = 0;
+					}
+					break;
+
+				case state::entity:
+					if (ch == ';') {
+						append_entity(out, true);
+						current = state::text;
+						++i;
+					} else if ((std::isalnum(static_cast<unsigned char>(ch)) || (ch == '#' && entity.empty())) &&
+					           entity.size() < max_entity) {
+						entity += ch;
+						++i;
+					} else {
+						append_entity(out, false);
+						current = state::text;
+					}
+					break;
+			}
+		}
+	}
+
+	std::string html_stripper::feed(std::string_view chunk) {
+		std::string out;
+		out.reserve(chunk.size());
+		feed(chunk, out);
+		return out;
+	}
+
+	void html_stripper::finish(std::string &out) {
+		switch (current) {
+			case state::tag_open:     out += '<';  break;
+			case state::end_tag_open: out += "</"; break;
+			case state::cdata:        out.append(run, ']'); break;
+			case state::entity:       append_entity(out, false); break;
+			default: break;
+		}
+
+		current = state::text;
+		name.clear();
+		closing = false;
+		declaration.clear();
+		run = 0;
+		raw_name.clear();
+		raw_matched = 0;
+		entity.clear();
+	}
+
+	std::string html_stripper::finish() {
+		std::string out;
+		finish(out);
+		return out;
+	}
+
+	void html_stripper::close_tag() {
+		if (!closing && (name == "script" || name == "style")) {
+			raw_name = name;
+			raw_matched = 0;
+			current = state::raw_text;
+		} else {
+			current = state::text;
+		}
+	}
+
+	void html_stripper::append_entity(std::string &out, bool terminated) const {
+		if (terminated && 1 < entity.size() && entity[0] == '#') {
+			const bool hex = entity[1] == 'x' || entity[1] == 'X';
+			const char *begin = entity.data() + (hex? 2 : 1), *end = entity.data() + entity.size();
+			uint64_t code = 0;
+			const auto [ptr, error] = std::from_chars(begin, end, code, hex? 16 : 10);
+			if (begin != end && ptr == end) {
+				append_utf8(out, error == std::errc()? code : 0);
+				return;
+			}
+		} else if (terminated) {
+			for (const auto &[entity_name, code]: named_entities) {
+				if (entity == entity_name) {
+					append_utf8(out, code);
+					return;
+				}
+			}
+		}
+
+		out += '&';
+		out += entity;
+		if (terminated)
+			out += ';';
+	}
+
+	std::string remove_html(std::string str) {
+		html_stripper stripper;
+		std::string out;
+		out.reserve(str.size());
+		stripper.feed(str, out);
+		stripper.finish(out);
+		return out;
 	}
 }
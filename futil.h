@@ -2,9 +2,19 @@
 #define FORMICINE_FUTIL_H_
 
 #include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace formicine::util {
@@ -40,25 +50,223 @@ namespace formicine::util {
 		return split(str, T(delimiter), condense);
 	}
 
+	/** Lazily splits a string by a given delimiter, yielding views into the original string without allocating. The
+	 *  tokens are the same as split()'s: an empty string has none, and if condense is true, empty tokens after the
+	 *  first are skipped. An empty delimiter yields the whole string. The string must outlive the view and the view
+	 *  must outlive its iterators. */
+	class split_view {
+		public:
+			class iterator {
+				public:
+					using iterator_category = std::forward_iterator_tag;
+					using value_type        = std::string_view;
+					using difference_type   = std::ptrdiff_t;
+					using pointer           = const std::string_view *;
+					using reference         = std::string_view;
+
+					iterator() = default;
+
+					std::string_view operator*() const { return parent->str.substr(start, stop - start); }
+
+					iterator & operator++() {
+						do {
+							if (stop == parent->str.size()) {
+								parent = nullptr;
+								start = stop = 0;
+								return *this;
+							}
+							start = stop + parent->delimiter_length();
+							stop = parent->find(start);
+						} while (parent->condense && start == stop);
+						return *this;
+					}
+
+					iterator operator++(int) {
+						iterator old = *this;
+						++*this;
+						return old;
+					}
+
+					bool operator==(const iterator &other) const {
+						return parent == other.parent && start == other.start;
+					}
+
+				private:
+					/** Null once the iterator has passed the last token. */
+					const split_view *parent = nullptr;
+					size_t start = 0, stop = 0;
+
+					iterator(const split_view *parent_): parent(parent_), stop(parent->find(0)) {}
+
+					friend class split_view;
+			};
+
+			split_view(std::string_view str_, std::string_view delimiter_, bool condense_ = true):
+				str(str_), delimiter(delimiter_), condense(condense_) {}
+
+			split_view(std::string_view str_, char delimiter_, bool condense_ = true):
+				str(str_), single(delimiter_), by_char(true), condense(condense_) {}
+
+			iterator begin() const { return str.empty()? iterator() : iterator(this); }
+			iterator end()   const { return {}; }
+
+		private:
+			std::string_view str, delimiter;
+			/** The delimiter when splitting by a single character, which takes a memchr fast path. */
+			char single = '\0';
+			bool by_char = false;
+			bool condense;
+
+			size_t delimiter_length() const { return by_char? 1 : delimiter.size(); }
+
+			/** Returns the index of the next delimiter at or after a given index, or the length of the string. */
+			size_t find(size_t from) const {
+				if (by_char || delimiter.size() == 1) {
+					const void *found = std::memchr(str.data() + from, by_char? single : delimiter[0], str.size() - from);
+					return found? static_cast<const char *>(found) - str.data() : str.size();
+				}
+				if (delimiter.empty())
+					return str.size();
+				const size_t found = str.find(delimiter, from);
+				return found == std::string_view::npos? str.size() : found;
+			}
+	};
+
+	/** Builds a string from pieces, formatting numbers with std::to_chars instead of going through a stream. */
+	class string_builder {
+		public:
+			explicit string_builder(size_t reserved = 0) { buffer.reserve(reserved); }
+
+			/** Makes room for at least a given number of characters in total. */
+			string_builder & reserve(size_t reserved) {
+				buffer.reserve(reserved);
+				return *this;
+			}
+
+			string_builder & append(std::string_view str) {
+				buffer.append(str);
+				return *this;
+			}
+
+			/** Without this, a string literal would be converted to bool rather than to std::string_view. */
+			string_builder & append(const char *str) {
+				return append(std::string_view(str));
+			}
+
+			string_builder & append(size_t count, char ch) {
+				buffer.append(count, ch);
+				return *this;
+			}
+
+			/** Characters are appended as themselves and bools as 1 or 0, as streams do by default. */
+			string_builder & append(char ch) {
+				buffer += ch;
+				return *this;
+			}
+
+			string_builder & append(signed char ch)   { return append(static_cast<char>(ch)); }
+			string_builder & append(unsigned char ch) { return append(static_cast<char>(ch)); }
+
+			string_builder & append(bool value) {
+				buffer += value? '1' : '0';
+				return *this;
+			}
+
+			template <typename T> requires std::is_integral_v<T>
+			string_builder & append(T value) {
+				char digits[std::numeric_limits<T>::digits10 + 3];
+				return append(std::string_view(digits, std::to_chars(digits, std::end(digits), value).ptr - digits));
+			}
+
+			/** Appends a floating-point number in the shortest form that reads back as the same value. */
+			template <typename T> requires std::is_floating_point_v<T>
+			string_builder & append(T value) {
+				char digits[64];
+				return append(std::string_view(digits, std::to_chars(digits, std::end(digits), value).ptr - digits));
+			}
+
+			/** Appends a floating-point number with a given format and precision, like printf's %e, %f or %g. */
+			template <typename T> requires std::is_floating_point_v<T>
+			string_builder & append(T value, std::chars_format format, int precision) {
+				// Fixed notation can need hundreds of digits, so fall back to an exactly sized buffer if necessary.
+				char digits[64];
+				const auto [end, error] = std::to_chars(digits, std::end(digits), value, format, precision);
+				if (error == std::errc())
+					return append(std::string_view(digits, end - digits));
+				std::string large(std::numeric_limits<T>::max_exponent10 + precision + 8, '\0');
+				return append(std::string_view(large.data(),
+					std::to_chars(large.data(), large.data() + large.size(), value, format, precision).ptr - large.data()));
+			}
+
+			template <typename T>
+			string_builder & operator<<(const T &value) {
+				return append(value);
+			}
+
+			size_t size() const { return buffer.size(); }
+			bool empty() const { return buffer.empty(); }
+			void clear() { buffer.clear(); }
+
+			std::string_view view() const { return buffer; }
+			std::string str() const & { return buffer; }
+			std::string str() && { return std::move(buffer); }
+
+		private:
+			std::string buffer;
+	};
+
+	/** Joins a range with a delimiter. Ranges of strings are joined with a single allocation of the exact size and
+	 *  numbers are formatted with std::to_chars, as a stream would format them by default; anything else is written
+	 *  to a stream. */
 	template <typename Iter>
 	std::string join(Iter begin, Iter end, const std::string &delim = " ") {
 		if (begin == end)
 			return "";
 
-		std::ostringstream oss;
-		bool first = true;
-		while (begin != end) {
-			if (!first) {
-				oss << delim;
-			} else {
-				first = false;
+		using value_type = std::remove_cvref_t<std::iter_reference_t<Iter>>;
+
+		if constexpr (std::is_convertible_v<std::iter_reference_t<Iter>, std::string_view> &&
+		              std::forward_iterator<Iter>) {
+			size_t size = 0, count = 0;
+			for (Iter iter = begin; iter != end; ++iter, ++count)
+				size += std::string_view(*iter).size();
+
+			std::string out;
+			out.reserve(size + (count - 1) * delim.size());
+			out.append(std::string_view(*begin));
+			while (++begin != end)
+				out.append(delim).append(std::string_view(*begin));
+			return out;
+		} else if constexpr (std::is_convertible_v<std::iter_reference_t<Iter>, std::string_view> ||
+		                     std::is_arithmetic_v<value_type>) {
+			string_builder builder;
+			for (bool first = true; begin != end; ++begin, first = false) {
+				if (!first)
+					builder.append(delim);
+				if constexpr (std::is_floating_point_v<value_type>)
+					builder.append(*begin, std::chars_format::general, 6);
+				else if constexpr (std::is_arithmetic_v<value_type>)
+					builder.append(*begin);
+				else
+					builder.append(std::string_view(*begin));
+			}
+			return std::move(builder).str();
+		} else {
+			std::ostringstream oss;
+			bool first = true;
+			while (begin != end) {
+				if (!first) {
+					oss << delim;
+				} else {
+					first = false;
+				}
+
+				oss << *begin;
+				++begin;
 			}
 
-			oss << *begin;
-			++begin;
+			return oss.str();
 		}
-
-		return oss.str();
 	}
 
 	template <typename Container>
@@ -110,6 +318,60 @@ namespace formicine::util {
 	/** Trims spaces and tabs from the end of a string. */
 	std::string   rtrim(const std::string &);
 
+	/**
+	 * The positions of the words in a string, where words are separated by any number of spaces, for answering
+	 * questions like word_indices() and index_of_word() without rescanning the string. It's built in one pass and
+	 * can be kept up to date as the string is edited, either through replace_word() or by reporting edits to
+	 * update(), which only rescans the words around the edit.
+	 */
+	class word_index {
+		public:
+			/** The positions of a word: its first character and the one just past its last. */
+			struct span {
+				size_t start, end;
+				size_t length() const { return end - start; }
+			};
+
+			explicit word_index(std::string_view = {});
+
+			/** Finds the first word that starts at or after from and before to, without scanning past its end, which
+			 *  is cut off at to. Returns {npos, npos} if there isn't one. This is the only word scanner: the index and
+			 *  the one-off helpers such as index_of_word() are both built on it. */
+			static span next_word(std::string_view, size_t from = 0, size_t to = std::string_view::npos);
+
+			/** Returns the number of words. */
+			size_t size() const { return spans.size(); }
+			const span & operator[](size_t n) const { return spans[n]; }
+
+			/** Returns the n-th word of a string the index is up to date with, or an empty view if there isn't one. */
+			std::string_view word(std::string_view, size_t n) const;
+
+			/** See util::word_indices(). O(log n). */
+			std::pair<ssize_t, ssize_t> locate(size_t cursor) const;
+
+			/** Returns the index of the first character of the n-th word, or the length of the string if there isn't
+			 *  one. */
+			size_t start_of(size_t n) const { return n < spans.size()? spans[n].start : length; }
+
+			/** Returns the index just past the n-th word, or the length of the string if there isn't one. */
+			size_t end_of(size_t n) const { return n < spans.size()? spans[n].end : length; }
+
+			/** Replaces the n-th word of a string the index is up to date with and updates the index. Returns the
+			 *  position just past the replacement, or -1 if there's no n-th word. */
+			ssize_t replace_word(std::string &, size_t n, std::string_view replacement);
+
+			/** Updates the index after an edit that replaced erased characters at a position with inserted ones.
+			 *  Takes the string as it is after the edit. */
+			void update(std::string_view, size_t pos, size_t erased, size_t inserted);
+
+		private:
+			std::vector<span> spans;
+			size_t length = 0;
+
+			/** Appends the spans of the words in part of a string, which must begin and end at word boundaries. */
+			static void scan(std::string_view, size_t from, size_t to, std::vector<span> &out);
+	};
+
 	/** Returns the index of the word that a given index is in in addition to the index within the word.
 	 *  If the cursor is within a group of multiple spaces between two words, the first value will be negative.
 	 *  If the first value is -1, the cursor is before the first word. -2 indicates that the cursor is before the
@@ -142,10 +404,93 @@ namespace formicine::util {
 	 *  false. */
 	bool parse_long(const std::string &, long &);
 
-	/** Replaces all occurrences of a substring in a string with another string. */
+	/** Replaces all occurrences of a substring in a string with another string in a single pass. Replacements aren't
+	 *  searched again. An empty substring leaves the string unchanged. */
 	std::string replace_all(std::string str, const std::string &to_replace, const std::string &replace_with);
 
-	/** Makes a naïve attempt to strip HTML tags from a string. */
+	/** Replaces several substrings at once in a single left-to-right pass over a string, using an Aho-Corasick
+	 *  automaton that's built once and can be reused for any number of strings. Where matches overlap, the one that
+	 *  starts first wins, and of those, the longest. Replacements aren't searched again. Empty patterns are ignored.
+	 *  The automaton takes 1 KB per distinct pattern prefix, so it suits small sets of short patterns. */
+	class replacer {
+		public:
+			replacer(const std::map<std::string, std::string> &replacements);
+			/** If a pattern appears more than once, its last replacement is used. */
+			replacer(std::initializer_list<std::pair<std::string, std::string>> replacements);
+
+			std::string operator()(std::string_view) const;
+
+		private:
+			static constexpr uint32_t no_match = UINT32_MAX;
+
+			/** The automaton's transitions: 256 per state, indexed by state * 256 + byte. State 0 is the root. */
+			std::vector<uint32_t> transitions;
+			/** The length of the string that leads to each state. */
+			std::vector<uint32_t> depths;
+			/** The longest pattern that's a suffix of the string leading to each state, or no_match. */
+			std::vector<uint32_t> matches;
+			std::vector<std::string> patterns, replacement_strings;
+
+			void add(const std::string &pattern, const std::string &replacement);
+			void build();
+	};
+
+	/** Replaces several substrings at once; see replacer. Reuse a replacer to avoid rebuilding its automaton. */
+	std::string replace_all(std::string_view, const std::map<std::string, std::string> &replacements);
+
+	/**
+	 * Strips HTML markup from a document fed to it in chunks of any size, in a single pass. Tags, comments, doctypes
+	 * and processing instructions are removed along with the bodies of <script> and <style> elements; CDATA sections
+	 * are kept as text, and character references such as &amp;, &#233; and &#x1F600; are decoded. A '<' that can't
+	 * begin a tag, as in "a < b", is kept. Markup and references split across chunks are handled, and the stripper
+	 * holds back at most a few dozen bytes between chunks, so memory stays bounded however large the document is.
+	 */
+	class html_stripper {
+		public:
+			html_stripper(bool decode_entities = true);
+
+			/** Strips a chunk of a document and appends its text to out. */
+			void feed(std::string_view chunk, std::string &out);
+			std::string feed(std::string_view chunk);
+
+			/** Ends the document, appending any text still held back to out. A tag left open at the end is dropped.
+			 *  The stripper can then be used for another document. */
+			void finish(std::string &out);
+			std::string finish();
+
+		private:
+			enum class state {
+				text, tag_open, end_tag_open, tag_name, attributes, quoted, declaration, comment, cdata, bogus,
+				raw_text, entity
+			};
+
+			static constexpr size_t max_name = 16;
+			static constexpr size_t max_entity = 32;
+
+			bool decode_entities;
+			state current = state::text;
+			/** The lowercased name of the current tag, truncated to max_name characters. */
+			std::string name;
+			bool closing = false;
+			/** The quote that closes the current attribute value. */
+			char quote = '\0';
+			/** What follows "<!" so far, while it might still begin a comment or a CDATA section. */
+			std::string declaration;
+			/** The number of consecutive dashes or closing brackets seen in a comment or a CDATA section. */
+			size_t run = 0;
+			/** The name of the element whose raw text is being skipped and how much of its end tag has been seen. */
+			std::string raw_name;
+			size_t raw_matched = 0;
+			/** The character reference being read, without the '&'. */
+			std::string entity;
+
+			/** Called at the '>' that ends a tag. */
+			void close_tag();
+			/** Appends the decoded character reference, or the reference as it was written if it isn't known. */
+			void append_entity(std::string &out, bool terminated) const;
+	};
+
+	/** Strips HTML markup from a string and decodes its character references; see html_stripper. */
 	std::string remove_html(std::string);
 
 	/** Returns a vector of all elements in a range that begin with a given string. */
@@ -1,76 +1,1908 @@
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <numeric>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#define FORMICINE_COUNTERS
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define FORMICINE_TSC
+#endif
+
 #include "performance.h"
 #include "ansi.h"
 
 namespace formicine {
+	namespace {
+		/** IDs start at 1 so that 0 can mean that no shard has been looked up yet. */
+		std::atomic<uint64_t> next_id = 1;
+
+		/** Adds to an atomic that only the calling thread writes to. */
+		void bump(std::atomic<uint64_t> &value, uint64_t added) {
+			value.store(value.load(std::memory_order_relaxed) + added, std::memory_order_relaxed);
+		}
+
+		/** Writes a string as a JSON string literal. */
+		void write_json_string(std::ostream &stream, std::string_view str) {
+			stream << '"';
+			for (const char ch: str) {
+				if (ch == '"' || ch == '\\') {
+					stream << '\\' << ch;
+				} else if (static_cast<unsigned char>(ch) < 0x20) {
+					char escape[8];
+					snprintf(escape, sizeof(escape), "\\u%04x", ch);
+					stream << escape;
+				} else {
+					stream << ch;
+				}
+			}
+			stream << '"';
+		}
+
+		constexpr uint32_t counter_bit(counter which) {
+			return uint32_t(1) << static_cast<size_t>(which);
+		}
+
+#ifdef FORMICINE_COUNTERS
+		/** The perf_event_open type and config of each counter, indexed by counter. */
+		constexpr std::pair<uint32_t, uint64_t> counter_events[counter_count] = {
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+			{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+			{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+		};
+
+		/** Opens a counter for the calling thread, optionally in an existing group. Returns -1 on failure. */
+		int open_counter(counter which, int group) {
+			const auto [type, config] = counter_events[static_cast<size_t>(which)];
+			perf_event_attr attr {};
+			attr.size = sizeof(attr);
+			attr.type = type;
+			attr.config = config;
+			attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			// Hardware events only count user space so that they open when kernel profiling isn't permitted. Context
+			// switches happen in the kernel, so counting them in user space only would always give zero.
+			attr.exclude_kernel = type == PERF_TYPE_HARDWARE;
+			attr.exclude_hv = 1;
+			return syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+		}
+#endif
+
+		/** Writes a field of a CSV row, quoting it if necessary. */
+		void write_csv_field(std::ostream &stream, std::string_view field) {
+			if (field.find_first_of(",\"\r\n") == std::string_view::npos) {
+				stream << field;
+				return;
+			}
+
+			stream << '"';
+			for (const char ch: field)
+				stream << (ch == '"'? "\"\"" : std::string_view(&ch, 1));
+			stream << '"';
+		}
+
+		/** A parsed JSON value. Numbers keep their text so that integers beyond 2^53 survive. */
+		struct json_value {
+			enum class kind {null, boolean, number, string, array, object};
+
+			kind type = kind::null;
+			bool boolean = false;
+			std::string text;
+			std::vector<json_value> items;
+			std::vector<std::pair<std::string, json_value>> members;
+
+			/** Returns an object's member, or nullptr if it has none by that name. */
+			const json_value * get(std::string_view key) const {
+				for (const auto &[name, value]: members) {
+					if (name == key)
+						return &value;
+				}
+				return nullptr;
+			}
+
+			/** Returns an object's member, throwing if it's missing or of the wrong kind. */
+			const json_value & at(std::string_view key, kind expected) const {
+				const json_value *value = get(key);
+				if (value == nullptr || value->type != expected)
+					throw std::runtime_error("Missing or invalid JSON member: " + std::string(key));
+				return *value;
+			}
+
+			uint64_t as_unsigned() const {
+				if (type != kind::number)
+					throw std::runtime_error("Expected a JSON number");
+				uint64_t out = 0;
+				const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), out);
+				if (error == std::errc() && end == text.data() + text.size())
+					return out;
+				const double value = std::strtod(text.c_str(), nullptr);
+				if (!(0 <= value))
+					throw std::runtime_error("Expected an unsigned JSON number: " + text);
+				return static_cast<uint64_t>(value);
+			}
+		};
+
+		/** A recursive descent JSON parser, enough to read back what write_json writes. */
+		class json_parser {
+			public:
+				json_parser(std::string_view input_): input(input_) {}
+
+				json_value parse() {
+					json_value out = parse_value(0);
+					skip_space();
+					if (pos != input.size())
+						fail("trailing characters");
+					return out;
+				}
+
+			private:
+				static constexpr int max_depth = 64;
+				std::string_view input;
+				size_t pos = 0;
+
+				[[noreturn]] void fail(const std::string &message) const {
+					throw std::runtime_error("Invalid JSON at offset " + std::to_string(pos) + ": " + message);
+				}
+
+				void skip_space() {
+					while (pos < input.size() && (input[pos] == ' ' || input[pos] == '\t' || input[pos] == '\n' ||
+					       input[pos] == '\r'))
+						++pos;
+				}
+
+				void expect(char ch) {
+					skip_space();
+					if (pos == input.size() || input[pos] != ch)
+						fail(std::string("expected '") + ch + "'");
+					++pos;
+				}
+
+				/** Consumes a character if it's next. */
+				bool accept(char ch) {
+					skip_space();
+					if (pos < input.size() && input[pos] == ch) {
+						++pos;
+						return true;
+					}
+					return false;
+				}
+
+				json_value parse_value(int depth) {
+					if (max_depth < depth)
+						fail("nested too deeply");
+
+					skip_space();
+					if (pos == input.size())
+						fail("unexpected end");
+
+					json_value out;
+					const char ch = input[pos];
+					if (ch == '{') {
+						++pos;
+						out.type = json_value::kind::object;
+						if (accept('}'))
+							return out;
+						do {
+							skip_space();
+							std::string key = parse_string();
+							expect(':');
+							out.members.emplace_back(std::move(key), parse_value(depth + 1));
+						} while (accept(','));
+						expect('}');
+					} else if (ch == '[') {
+						++pos;
+						out.type = json_value::kind::array;
+						if (accept(']'))
+							return out;
+						do {
+							out.items.push_back(parse_value(depth + 1));
+						} while (accept(','));
+						expect(']');
+					} else if (ch == '"') {
+						out.type = json_value::kind::string;
+						out.text = parse_string();
+					} else if (input.substr(pos, 4) == "true" || input.substr(pos, 5) == "false") {
+						out.type = json_value::kind::boolean;
+						out.boolean = ch == 't';
+						pos += out.boolean? 4 : 5;
+					} else if (input.substr(pos, 4) == "null") {
+						pos += 4;
+					} else if (ch == '-' || ('0' <= ch && ch <= '9')) {
+						const size_t start = pos;
+						while (pos < input.size() && (std::isdigit(static_cast<unsigned char>(input[pos])) ||
+						       input[pos] == '-' || input[pos] == '+' || input[pos] == '.' || input[pos] == 'e' ||
+						       input[pos] == 'E'))
+							++pos;
+						out.type = json_value::kind::number;
+						out.text = input.substr(start, pos - start);
+					} else {
+						fail(std::string("unexpected '") + ch + "'");
+					}
+					return out;
+				}
+
+				std::string parse_string() {
+					if (pos == input.size() || input[pos] != '"')
+						fail("expected a string");
+					++pos;
+
+					std::string out;
+					while (pos < input.size() && input[pos] != '"') {
+						const char ch = input[pos++];
+						if (ch != '\\') {
+							out += ch;
+							continue;
+						}
+
+						if (pos == input.size())
+							break;
+						const char escaped = input[pos++];
+						switch (escaped) {
+							case 'b': out += '\b'; break;
+							case 'f': out += '\f'; break;
+							case 'n': out += '\n'; break;
+							case 'r': out += '\r'; break;
+							case 't': out += '\t'; break;
+							case 'u': {
+								unsigned code = 0;
+								if (input.size() < pos + 4 || std::from_chars(input.data() + pos, input.data() + pos + 4,
+								    code, 16).ptr != input.data() + pos + 4)
+									fail("invalid \\u escape");
+								pos += 4;
+								// Surrogate pairs aren't combined; timer names written by write_json never need them.
+								if (code < 0x80) {
+									out += static_cast<char>(code);
+								} else if (code < 0x800) {
+									out += static_cast<char>(0xc0 | code >> 6);
+									out += static_cast<char>(0x80 | (code & 0x3f));
+								} else {
+									out += static_cast<char>(0xe0 | code >> 12);
+									out += static_cast<char>(0x80 | (code >> 6 & 0x3f));
+									out += static_cast<char>(0x80 | (code & 0x3f));
+								}
+								break;
+							}
+							default: out += escaped;
+						}
+					}
+
+					if (pos == input.size())
+						fail("unterminated string");
+					++pos;
+					return out;
+				}
+		};
+
+		/** Formats a duration with a unit suited to its magnitude. */
+		std::string format_duration(performance::timetype duration) {
+			const double ns = duration.count();
+			char buffer[32];
+			if (ns < 1e3)
+				snprintf(buffer, sizeof(buffer), "%.0f ns", ns);
+			else if (ns < 1e6)
+				snprintf(buffer, sizeof(buffer), "%.1f μs", ns / 1e3);
+			else if (ns < 1e9)
+				snprintf(buffer, sizeof(buffer), "%.1f ms", ns / 1e6);
+			else
+				snprintf(buffer, sizeof(buffer), "%.2f s", ns / 1e9);
+			return buffer;
+		}
+
+#ifndef DISABLE_PERFORMANCE
+		void report([[maybe_unused]] const std::string &label, const performance::timer_stats &stats) {
+			// Sampled timers report their invocation count and an extrapolated total. Everything here is only used by
+			// DBG, which compiles to nothing when NODEBUG is defined.
+			const bool sampled = stats.count < stats.invocations;
+			[[maybe_unused]] const auto total = std::chrono::duration_cast<std::chrono::microseconds>(stats.estimated_total()).count();
+			[[maybe_unused]] const auto mean  = std::chrono::duration_cast<std::chrono::microseconds>(stats.mean()).count();
+			char rate[48] = "";
+			if (sampled)
+				snprintf(rate, sizeof(rate), "; sampled %.3g%%", stats.sampling_rate() * 100);
+			std::string counted;
+			if (stats.has(counter::cycles) && stats.has(counter::instructions)) {
+				char ipc[32];
+				snprintf(ipc, sizeof(ipc), "; IPC %.2f", stats.ipc());
+				counted = ipc;
+			}
+			for (const counter which: {counter::cache_misses, counter::branch_misses, counter::context_switches,
+			                           counter::page_faults}) {
+				if (stats.has(which)) {
+					char per_call[64];
+					snprintf(per_call, sizeof(per_call), "; %.3g %s/call", stats.per_call(which),
+						std::string(counter_name(which)).c_str());
+					counted += per_call;
+				}
+			}
+			DBG(label << ": "_d << ansi::cyan(std::to_string(stats.invocations)) << " -> "_d << ansi::orange((sampled? "~" : "") + std::to_string(total)) << " μs (average: " << ansi::magenta(std::to_string(mean)) << " μs; p50 "_d << format_duration(stats.percentile(50)) << ", p90 "_d << format_duration(stats.percentile(90)) << ", p99 "_d << format_duration(stats.percentile(99)) << ", p99.9 "_d << format_duration(stats.percentile(99.9)) << ", max "_d << format_duration(stats.max) << rate << counted << ")");
+		}
+#endif
+	}
+
+	struct performance::shard {
+		/** A timer's data within a shard. Only the owning thread writes to it, but the reporting thread can read it at
+		 *  any time. */
+		struct record {
+			/** The clock reading at which the timer was last started. Never read by other threads. */
+			uint64_t started = 0;
+			histogram times;
+			/** Every start of the timer, whether it was sampled or not. */
+			std::atomic<uint64_t> invocations = 0;
+
+			/** The sampling configuration as of sampling_version. Never read by other threads. */
+			uint64_t sampling_version = 0;
+			uint32_t interval = 1;
+			bool random = false;
+			/** The number of starts until the next one that's sampled. */
+			uint32_t countdown = 1;
+			/** Whether the last start was skipped, so that the matching stop should be too. */
+			bool skipped = false;
+
+			/** The counter readings at the last start and which of them were read. Never read by other threads. */
+			std::array<uint64_t, counter_count> started_counters {};
+			uint32_t started_mask = 0;
+			/** The counter totals over measured invocations and the number of invocations each counter was read for. */
+			std::array<std::atomic<uint64_t>, counter_count> counters {};
+			std::array<std::atomic<uint64_t>, counter_count> counted {};
+
+			record(int precision): times(precision) {}
+		};
+
+		/** A node in the thread's call tree. */
+		struct scope_node {
+			timer_handle handle;
+			/** The index of the enclosing node, or no_node. Nodes always come after their parents. */
+			uint32_t parent;
+			/** Links used only by the owning thread to find child nodes. */
+			uint32_t first_child = no_node;
+			uint32_t next_sibling = no_node;
+			std::atomic<uint64_t> count = 0;
+			std::atomic<uint64_t> inclusive = 0;
+			/** The inclusive time of all the scopes nested directly in this one. */
+			std::atomic<uint64_t> children = 0;
+
+			scope_node(timer_handle handle_, uint32_t parent_): handle(handle_), parent(parent_) {}
+		};
+
+		/** An open scope on the thread's scope stack. */
+		struct frame {
+			uint32_t node;
+			uint64_t started;
+			uint32_t counter_mask;
+			std::array<uint64_t, counter_count> counters;
+		};
+
+		/** A group of counters that the kernel reads together in one system call. */
+		struct counter_group {
+			int fd;
+			/** The counters in the order the kernel reports them, leader first. */
+			std::vector<counter> members;
+		};
+
+		/** A slot in the trace ring. The owning thread writes it under a sequence lock so that other threads can
+		 *  copy it out while tracing continues. */
+		struct trace_slot {
+			/** Odd while the slot is being written; otherwise 2n + 2 for the nth event written on the thread. */
+			std::atomic<uint64_t> sequence = 0;
+			std::atomic<uint64_t> reading = 0;
+			/** The timer handle shifted left by one, with the low bit set for end events. */
+			std::atomic<uint64_t> event = 0;
+		};
+
+		static constexpr uint32_t no_node = UINT32_MAX;
+
+		const size_t thread;
+		const int precision;
+		std::atomic<bool> exited = false;
+
+		/** Taken by the owning thread when it adds records and by other threads while they read them. Records are
+		 *  never removed and a deque never moves its elements, so the owning thread can use them without it. */
+		std::mutex mutex;
+		std::deque<record> records;
+		/** Guarded by the mutex in the same way as the records. */
+		std::deque<scope_node> nodes;
+
+		/** Allocated by the owning thread under the mutex when it first records a trace event. */
+		std::unique_ptr<trace_slot[]> ring;
+		size_t ring_size = 0;
+		/** The number of trace events ever written to the ring. */
+		std::atomic<uint64_t> traced = 0;
+
+		/** Only used by the owning thread. */
+		std::vector<frame> stack;
+		uint32_t first_root = no_node;
+		/** The state of the thread's xorshift generator for random sampling. */
+		uint64_t random_state;
+
+		/** The thread's counters, opened the first time they're read. Only used by the owning thread. */
+		bool counters_opened = false;
+		std::vector<counter_group> counter_groups;
+		/** The counters read from getrusage because perf_event_open couldn't count them. */
+		uint32_t rusage_mask = 0;
+		/** Every counter available on the thread. */
+		uint32_t counter_mask = 0;
+
+		shard(size_t thread_, int precision_):
+			thread(thread_), precision(precision_), random_state(0x9e3779b97f4a7c15ull * thread_) {}
+
+		~shard() {
+			close_counters();
+		}
+
+		/** Opens as many counters as the kernel allows. Each one joins the group before it if it can, so that usually
+		 *  a single read gets them all. */
+		void open_counters() {
+			counters_opened = true;
+#ifdef FORMICINE_COUNTERS
+			for (size_t index = 0; index < counter_count; ++index) {
+				const counter which = static_cast<counter>(index);
+				int fd = counter_groups.empty()? -1 : open_counter(which, counter_groups.back().fd);
+				if (fd != -1) {
+					counter_groups.back().members.push_back(which);
+				} else {
+					fd = open_counter(which, -1);
+					if (fd == -1)
+						continue;
+					counter_groups.push_back({fd, {which}});
+				}
+				counter_mask |= counter_bit(which);
+			}
+
+			const uint32_t kernel = counter_bit(counter::context_switches) | counter_bit(counter::page_faults);
+			rusage_mask = kernel & ~counter_mask;
+			counter_mask |= rusage_mask;
+#endif
+		}
+
+		void close_counters() {
+#ifdef FORMICINE_COUNTERS
+			for (const counter_group &group: counter_groups)
+				close(group.fd);
+#endif
+			counter_groups.clear();
+			counter_mask = rusage_mask = 0;
+		}
+
+		/** Reads the thread's counters, opening them if necessary, and returns which ones were read. */
+		uint32_t read_counters(std::array<uint64_t, counter_count> &out) {
+			if (!counters_opened)
+				open_counters();
+
+			uint32_t mask = 0;
+#ifdef FORMICINE_COUNTERS
+			for (const counter_group &group: counter_groups) {
+				// The group read format is the number of counters, the times enabled and running, then the values.
+				uint64_t values[3 + counter_count];
+				const ssize_t size = (3 + group.members.size()) * sizeof(uint64_t);
+				if (read(group.fd, values, size) != size || values[2] == 0)
+					continue;
+				// If the kernel had to multiplex the counters, scale them up to the whole time they were enabled.
+				const double scale = values[2] < values[1]? static_cast<double>(values[1]) / values[2] : 1.0;
+				for (size_t i = 0; i < group.members.size(); ++i) {
+					out[static_cast<size_t>(group.members[i])] = scale == 1.0? values[3 + i]
+						: static_cast<uint64_t>(values[3 + i] * scale);
+					mask |= counter_bit(group.members[i]);
+				}
+			}
+
+			if (rusage_mask != 0) {
+				rusage usage;
+				if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+					out[static_cast<size_t>(counter::context_switches)] = usage.ru_nvcsw + usage.ru_nivcsw;
+					out[static_cast<size_t>(counter::page_faults)] = usage.ru_minflt + usage.ru_majflt;
+					mask |= rusage_mask;
+				}
+			}
+#else
+			(void) out;
+#endif
+			return mask;
+		}
+
+		/** Reads the counters again and adds what they counted since an earlier reading to a timer's totals. */
+		void add_counters(record &rec, uint32_t started_mask, const std::array<uint64_t, counter_count> &started) {
+			std::array<uint64_t, counter_count> current;
+			const uint32_t mask = read_counters(current) & started_mask;
+			for (size_t index = 0; index < counter_count; ++index) {
+				if (mask & (uint32_t(1) << index)) {
+					// Scaled readings of multiplexed counters can go backwards slightly.
+					bump(rec.counters[index], started[index] < current[index]? current[index] - started[index] : 0);
+					bump(rec.counted[index], 1);
+				}
+			}
+		}
+
+		/** Returns a uniformly distributed number in (0, 1]. */
+		double next_random() {
+			random_state ^= random_state << 13;
+			random_state ^= random_state >> 7;
+			random_state ^= random_state << 17;
+			return ((random_state >> 11) + 1) * 0x1p-53;
+		}
+
+		/** Returns the number of starts until the next sampled one. */
+		uint32_t next_countdown(const record &rec) {
+			if (!rec.random)
+				return rec.interval;
+			// Geometrically distributed gaps make each start independently sampled with a probability of
+			// 1/interval, without drawing a random number on every start.
+			const double gap = std::floor(std::log(next_random()) / std::log1p(-1.0 / rec.interval));
+			return static_cast<uint32_t>(std::min(gap, 4e9)) + 1;
+		}
+
+		/** Counts a start of a timer and decides whether it's sampled. */
+		bool sample(record &rec) {
+			bump(rec.invocations, 1);
+			if (rec.interval == 1)
+				return true;
+			if (--rec.countdown != 0)
+				return false;
+			rec.countdown = next_countdown(rec);
+			return true;
+		}
+
+		record & get(timer_handle handle) {
+			if (records.size() <= handle) {
+				std::lock_guard lock(mutex);
+				while (records.size() <= handle)
+					records.emplace_back(precision);
+			}
+
+			return records[handle];
+		}
+
+		void add(timer_handle handle, uint64_t nanoseconds) {
+			records[handle].times.record(nanoseconds);
+		}
+
+		void trace(size_t capacity, uint64_t reading, timer_handle handle, bool end) {
+			if (!ring) {
+				std::lock_guard lock(mutex);
+				ring = std::make_unique<trace_slot[]>(capacity);
+				ring_size = capacity;
+			}
+
+			const uint64_t count = traced.load(std::memory_order_relaxed);
+			trace_slot &slot = ring[count % ring_size];
+			slot.sequence.store(2 * count + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			slot.reading.store(reading, std::memory_order_relaxed);
+			slot.event.store(uint64_t(handle) << 1 | end, std::memory_order_relaxed);
+			slot.sequence.store(2 * count + 2, std::memory_order_release);
+			traced.store(count + 1, std::memory_order_release);
+		}
+
+		/** Copies out the events still in the ring that weren't being overwritten at the time. Must be called with
+		 *  the mutex held. */
+		std::vector<std::pair<uint64_t, uint64_t>> trace_events() const {
+			std::vector<std::pair<uint64_t, uint64_t>> out;
+			if (!ring)
+				return out;
+
+			const uint64_t end = traced.load(std::memory_order_acquire);
+			out.reserve(std::min<uint64_t>(end, ring_size));
+			for (uint64_t count = end < ring_size? 0 : end - ring_size; count < end; ++count) {
+				const trace_slot &slot = ring[count % ring_size];
+				const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+				if (sequence != 2 * count + 2)
+					continue;
+				const uint64_t reading = slot.reading.load(std::memory_order_relaxed);
+				const uint64_t event = slot.event.load(std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (slot.sequence.load(std::memory_order_relaxed) == sequence)
+					out.emplace_back(reading, event);
+			}
+
+			return out;
+		}
+
+		/** Returns the index of the node for a timer under a given parent node, creating it if necessary. */
+		uint32_t find_node(timer_handle handle, uint32_t parent) {
+			uint32_t &first = parent == no_node? first_root : nodes[parent].first_child;
+			for (uint32_t index = first; index != no_node; index = nodes[index].next_sibling) {
+				if (nodes[index].handle == handle)
+					return index;
+			}
+
+			const uint32_t index = nodes.size();
+			{
+				std::lock_guard lock(mutex);
+				nodes.emplace_back(handle, parent);
+			}
+			nodes[index].next_sibling = first;
+			first = index;
+			return index;
+		}
+
+		/** Must be called with the mutex held. */
+		timer_stats collect(timer_handle handle) const {
+			if (records.size() <= handle)
+				return {};
+
+			const record &rec = records[handle];
+			const uint64_t invocations = rec.invocations.load(std::memory_order_relaxed);
+			if (rec.times.count() == 0 && invocations == 0)
+				return {};
+
+			timer_stats out;
+			out.distribution = rec.times;
+			out.invocations = std::max(invocations, out.distribution.count());
+			out.count = out.distribution.count();
+			out.total = timetype(out.distribution.sum());
+			out.min   = timetype(out.distribution.min());
+			out.max   = timetype(out.distribution.max());
+			for (size_t index = 0; index < counter_count; ++index) {
+				out.counters[index] = rec.counters[index].load(std::memory_order_relaxed);
+				out.counted[index]  = rec.counted[index].load(std::memory_order_relaxed);
+			}
+			return out;
+		}
+	};
+
 	performance perf = {};
 
-	watcher::watcher(const std::string &name_, performance *parent_): name(name_), parent(parent_) {
+	watcher::watcher(timer_handle handle_, performance *parent_): handle(handle_), parent(parent_) {
 #ifndef DISABLE_PERFORMANCE
-		restart();
+		sampled = parent->enter(handle);
 #endif
 	}
 
 	watcher::~watcher() {
 #ifndef DISABLE_PERFORMANCE
-		if (!canceled)
-			parent->stop(name);
+		if (sampled)
+			parent->leave(handle, canceled);
 #endif
 	}
 
 	void watcher::restart() {
 #ifndef DISABLE_PERFORMANCE
-		parent->start(name);
+		if (sampled)
+			parent->restart(handle);
 #endif
 	}
 
+	histogram::histogram(int precision_): precision(precision_) {
+		if (precision < 0 || max_precision < precision)
+			throw std::invalid_argument("Invalid histogram precision: " + std::to_string(precision));
+		size = static_cast<size_t>(range_bits - precision + 1) << precision;
+		buckets = std::make_unique<std::atomic<uint64_t>[]>(size);
+	}
+
+	histogram::histogram(const histogram &other): histogram(other.precision) {
+		copy(other);
+	}
+
+	histogram & histogram::operator=(const histogram &other) {
+		if (this == &other)
+			return *this;
+
+		if (precision != other.precision) {
+			precision = other.precision;
+			size = other.size;
+			buckets = std::make_unique<std::atomic<uint64_t>[]>(size);
+		}
+
+		copy(other);
+		return *this;
+	}
+
+	void histogram::copy(const histogram &other) {
+		auto copy_fields = [&] {
+			for (size_t i = 0; i < size; ++i)
+				buckets[i].store(other.bucket(i), std::memory_order_relaxed);
+			total_count.store(other.count(), std::memory_order_relaxed);
+			total_sum.store(other.sum(), std::memory_order_relaxed);
+			minimum.store(other.minimum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			maximum.store(other.max(), std::memory_order_relaxed);
+		};
+
+		for (int attempt = 0; attempt < 64; ++attempt) {
+			const uint64_t before = other.sequence.load(std::memory_order_acquire);
+			if (before % 2 == 0) {
+				copy_fields();
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (other.sequence.load(std::memory_order_relaxed) == before)
+					return;
+			}
+			std::this_thread::yield();
+		}
+
+		// The other histogram is being recorded into too often to copy cleanly, so at least make the count match
+		// the buckets that were copied, which the percentiles are computed from.
+		copy_fields();
+		uint64_t total = 0;
+		for (size_t i = 0; i < size; ++i)
+			total += bucket(i);
+		total_count.store(total, std::memory_order_relaxed);
+	}
+
+	void histogram::record(uint64_t value) {
+		// Only one thread records into a histogram, so plain loads and stores suffice and avoid locked instructions.
+		const uint64_t before = sequence.load(std::memory_order_relaxed);
+		sequence.store(before + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		std::atomic<uint64_t> &counter = buckets[index(value)];
+		counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		total_count.store(total_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		total_sum.store(total_sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		if (value < minimum.load(std::memory_order_relaxed))
+			minimum.store(value, std::memory_order_relaxed);
+		if (maximum.load(std::memory_order_relaxed) < value)
+			maximum.store(value, std::memory_order_relaxed);
+		sequence.store(before + 2, std::memory_order_release);
+	}
+
+	void histogram::record(uint64_t value, uint64_t times) {
+		if (times == 0)
+			return;
+		const uint64_t before = sequence.load(std::memory_order_relaxed);
+		sequence.store(before + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		std::atomic<uint64_t> &counter = buckets[index(value)];
+		counter.store(counter.load(std::memory_order_relaxed) + times, std::memory_order_relaxed);
+		total_count.store(total_count.load(std::memory_order_relaxed) + times, std::memory_order_relaxed);
+		total_sum.store(total_sum.load(std::memory_order_relaxed) + value * times, std::memory_order_relaxed);
+		if (value < minimum.load(std::memory_order_relaxed))
+			minimum.store(value, std::memory_order_relaxed);
+		if (maximum.load(std::memory_order_relaxed) < value)
+			maximum.store(value, std::memory_order_relaxed);
+		sequence.store(before + 2, std::memory_order_release);
+	}
+
+	void histogram::merge(const histogram &other) {
+		if (other.count() == 0)
+			return;
+
+		if (precision != other.precision) {
+			if (count() != 0)
+				throw std::invalid_argument("Can't merge histograms of different precisions");
+			*this = histogram(other.precision);
+		}
+
+		for (size_t i = 0; i < size; ++i) {
+			const uint64_t added = other.bucket(i);
+			if (added != 0)
+				buckets[i].fetch_add(added, std::memory_order_relaxed);
+		}
+
+		total_count.fetch_add(other.count(), std::memory_order_relaxed);
+		total_sum.fetch_add(other.sum(), std::memory_order_relaxed);
+		if (other.min() < minimum.load(std::memory_order_relaxed))
+			minimum.store(other.min(), std::memory_order_relaxed);
+		if (maximum.load(std::memory_order_relaxed) < other.max())
+			maximum.store(other.max(), std::memory_order_relaxed);
+	}
+
+	void histogram::clear() {
+		for (size_t i = 0; i < size; ++i)
+			buckets[i].store(0, std::memory_order_relaxed);
+		total_count.store(0, std::memory_order_relaxed);
+		total_sum.store(0, std::memory_order_relaxed);
+		minimum.store(UINT64_MAX, std::memory_order_relaxed);
+		maximum.store(0, std::memory_order_relaxed);
+	}
+
+	histogram histogram::since(const histogram &earlier) const {
+		histogram out(precision);
+		if (earlier.count() != 0 && earlier.precision != precision)
+			throw std::invalid_argument("Can't subtract histograms of different precisions");
+
+		size_t first = size, last = 0;
+		for (size_t i = 0; i < size; ++i) {
+			const uint64_t before = earlier.count() == 0? 0 : earlier.bucket(i);
+			const uint64_t now = bucket(i);
+			if (before < now) {
+				out.buckets[i].store(now - before, std::memory_order_relaxed);
+				first = std::min(first, i);
+				last = i;
+			}
+		}
+
+		if (first == size)
+			return out;
+
+		uint64_t added = 0;
+		for (size_t i = first; i <= last; ++i)
+			added += out.bucket(i);
+		out.total_count.store(added, std::memory_order_relaxed);
+		out.total_sum.store(sum() < earlier.sum()? 0 : sum() - earlier.sum(), std::memory_order_relaxed);
+		out.minimum.store(std::max(bucket_lower(first), min()), std::memory_order_relaxed);
+		out.maximum.store(earlier.max() < max()? max() : std::min(bucket_upper(last), max()),
+			std::memory_order_relaxed);
+		return out;
+	}
+
+	uint64_t histogram::min() const {
+		return count() == 0? 0 : minimum.load(std::memory_order_relaxed);
+	}
+
+	uint64_t histogram::value_at(double quantile) const {
+		const uint64_t total = count();
+		if (total == 0)
+			return 0;
+
+		quantile = std::clamp(quantile, 0.0, 1.0);
+		const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(quantile * total)));
+		uint64_t seen = 0;
+		for (size_t i = 0; i < size; ++i) {
+			seen += bucket(i);
+			if (rank <= seen) {
+				const uint64_t lower = bucket_lower(i), upper = bucket_upper(i);
+				return std::clamp(lower + (upper - lower) / 2, min(), max());
+			}
+		}
+
+		// Buckets may have been recorded into since the count was read.
+		return max();
+	}
+
+	uint64_t histogram::bucket_lower(size_t index) const {
+		const size_t sub_buckets = size_t(1) << precision;
+		if (index < sub_buckets)
+			return index;
+		const int shift = (index >> precision) - 1;
+		return static_cast<uint64_t>((index & (sub_buckets - 1)) | sub_buckets) << shift;
+	}
+
+	uint64_t histogram::bucket_upper(size_t index) const {
+		return bucket_lower(index + 1) - 1;
+	}
+
+	size_t histogram::index(uint64_t value) const {
+		const uint64_t sub_buckets = uint64_t(1) << precision;
+		value = std::min(value, (uint64_t(1) << range_bits) - 1);
+		if (value < sub_buckets)
+			return value;
+
+		// Values in [2^e, 2^(e+1)) are split into 2^precision buckets of width 2^(e-precision).
+		const int shift = 63 - __builtin_clzll(value) - precision;
+		return ((shift + 1) << precision) + ((value >> shift) - sub_buckets);
+	}
+
+	std::string_view counter_name(counter which) {
+		switch (which) {
+			case counter::cycles:           return "cycles";
+			case counter::instructions:     return "instructions";
+			case counter::cache_misses:     return "cache misses";
+			case counter::branch_misses:    return "branch misses";
+			case counter::context_switches: return "context switches";
+			case counter::page_faults:      return "page faults";
+		}
+		throw std::invalid_argument("Invalid counter: " + std::to_string(static_cast<int>(which)));
+	}
+
+	double performance::timer_stats::per_call(counter which) const {
+		const size_t index = static_cast<size_t>(which);
+		return counted[index] == 0? 0.0 : static_cast<double>(counters[index]) / counted[index];
+	}
+
+	double performance::timer_stats::ipc() const {
+		const uint64_t cycles = counters[static_cast<size_t>(counter::cycles)];
+		return cycles == 0? 0.0 : static_cast<double>(counters[static_cast<size_t>(counter::instructions)]) / cycles;
+	}
+
+	performance::timetype performance::timer_stats::percentile(double percent) const {
+		return timetype(distribution.value_at(percent / 100.0));
+	}
+
+	performance::timer_stats performance::timer_stats::since(const timer_stats &earlier) const {
+		timer_stats out;
+		out.distribution = distribution.since(earlier.distribution);
+		out.count = out.distribution.count();
+		out.invocations = earlier.invocations < invocations? invocations - earlier.invocations : 0;
+		out.total = timetype(out.distribution.sum());
+		out.min   = timetype(out.distribution.min());
+		out.max   = timetype(out.distribution.max());
+		for (size_t index = 0; index < counter_count; ++index) {
+			out.counters[index] = earlier.counters[index] < counters[index]? counters[index] - earlier.counters[index] : 0;
+			out.counted[index]  = earlier.counted[index]  < counted[index]?  counted[index]  - earlier.counted[index]  : 0;
+		}
+		return out;
+	}
+
+	const performance::stats_snapshot::entry * performance::stats_snapshot::find(timer_handle handle) const {
+		for (const entry &timer: timers) {
+			if (timer.handle == handle)
+				return &timer;
+		}
+		return nullptr;
+	}
+
+	void performance::timer_stats::merge(const timer_stats &other) {
+		invocations += other.invocations;
+		for (size_t index = 0; index < counter_count; ++index) {
+			counters[index] += other.counters[index];
+			counted[index]  += other.counted[index];
+		}
+		if (other.count == 0)
+			return;
+		min = count == 0? other.min : std::min(min, other.min);
+		max = std::max(max, other.max);
+		count += other.count;
+		total += other.total;
+		distribution.merge(other.distribution);
+	}
+
+	performance::performance(): id(next_id++) {}
+
 	performance::~performance() {
+		stop_reporter();
 #ifndef DISABLE_PERFORMANCE
 		results();
 #endif
 	}
 
+	uint64_t performance::now() const {
+#ifdef FORMICINE_TSC
+		if (tsc)
+			return __rdtsc();
+#endif
+		return std::chrono::steady_clock::now().time_since_epoch().count();
+	}
+
+	performance::timetype performance::elapsed(uint64_t from, uint64_t to) const {
+		if (tsc)
+			return timetype(static_cast<timetype::rep>((to - from) * tsc_period));
+		return std::chrono::duration_cast<timetype>(std::chrono::steady_clock::duration(to - from));
+	}
+
+	performance::shard & performance::local_shard() {
+		// Shards outlive both their threads and the performance object: the thread marks its shard as exited when it
+		// exits, and the performance object keeps it for reporting.
+		struct holder {
+			std::shared_ptr<shard> ptr;
+
+			~holder() {
+				if (ptr) {
+					// Counters belong to the thread, so there's nothing left for them to count.
+					ptr->close_counters();
+					ptr->exited.store(true, std::memory_order_release);
+				}
+			}
+		};
+
+		thread_local uint64_t cached_id = 0;
+		thread_local shard *cached = nullptr;
+		if (cached_id == id)
+			return *cached;
+
+		thread_local std::unordered_map<uint64_t, holder> held;
+		holder &found = held[id];
+		if (!found.ptr) {
+			std::lock_guard lock(shards_mutex);
+			found.ptr = std::make_shared<shard>(shards.size() + 1, precision);
+			shards.push_back(found.ptr);
+		}
+
+		cached_id = id;
+		cached = found.ptr.get();
+		return *cached;
+	}
+
+	timer_handle performance::timer(std::string_view timer_name) {
+		// Each thread caches the handles it has looked up, so the lock is only taken the first time a thread uses a
+		// name. The cache pointer and ID are trivially destructible, so they can still be checked after the caches
+		// are destroyed as the thread exits; from then on, lookups take the lock.
+		using name_map = std::unordered_map<std::string, timer_handle, name_hash, std::equal_to<>>;
+		thread_local uint64_t cached_id = 0;
+		thread_local name_map *cached = nullptr;
+		thread_local bool caches_destroyed = false;
+
+		struct caches {
+			std::unordered_map<uint64_t, name_map> maps;
+
+			~caches() {
+				cached_id = 0;
+				cached = nullptr;
+				caches_destroyed = true;
+			}
+		};
+
+		if (cached_id != id && !caches_destroyed) {
+			thread_local caches local;
+			cached = &local.maps[id];
+			cached_id = id;
+		}
+
+		if (cached != nullptr) {
+			auto found = cached->find(timer_name);
+			if (found != cached->end())
+				return found->second;
+		}
+
+		timer_handle handle;
+		{
+			std::lock_guard lock(names_mutex);
+			auto iter = handles.find(timer_name);
+			if (iter != handles.end()) {
+				handle = iter->second;
+			} else {
+				handle = names.size();
+				handles.emplace(timer_name, handle);
+				names.emplace_back(timer_name);
+			}
+		}
+
+		if (cached != nullptr)
+			cached->emplace(timer_name, handle);
+		return handle;
+	}
+
+	timer_handle performance::timer(std::string_view timer_name, uint64_t key) {
+		for (size_t i = 0; i < keyed_capacity; ++i) {
+			const keyed_timer &entry = keyed[(key + i) % keyed_capacity];
+			const uint64_t found = entry.key.load(std::memory_order_acquire);
+			if (found == 0)
+				break;
+			if (found == key && *entry.name.load(std::memory_order_relaxed) == timer_name)
+				return entry.handle.load(std::memory_order_relaxed);
+		}
+
+		const timer_handle handle = timer(timer_name);
+
+		// Another thread may have added the name since the probe above, so probe again with the lock held.
+		std::lock_guard lock(names_mutex);
+		for (size_t i = 0; i < keyed_capacity; ++i) {
+			keyed_timer &entry = keyed[(key + i) % keyed_capacity];
+			const uint64_t found = entry.key.load(std::memory_order_relaxed);
+			if (found == 0) {
+				entry.name.store(&names[handle], std::memory_order_relaxed);
+				entry.handle.store(handle, std::memory_order_relaxed);
+				entry.key.store(key, std::memory_order_release);
+				break;
+			}
+
+			if (found == key && *entry.name.load(std::memory_order_relaxed) == timer_name)
+				break;
+		}
+
+		return handle;
+	}
+
+	const std::string & performance::get_name(timer_handle handle) const {
+		std::lock_guard lock(names_mutex);
+		if (names.size() <= handle)
+			throw std::out_of_range("Invalid timer handle: " + std::to_string(handle));
+		return names[handle];
+	}
+
+	bool performance::use_tsc(bool enable) {
+		tsc = false;
+#ifdef FORMICINE_TSC
+		if (!enable)
+			return false;
+
+		// Only an invariant timestamp counter ticks at a constant rate regardless of frequency scaling and sleep
+		// states.
+		unsigned eax, ebx, ecx, edx;
+		if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+			return false;
+
+		const auto clock_start = std::chrono::steady_clock::now();
+		const uint64_t tsc_start = __rdtsc();
+		while (std::chrono::steady_clock::now() - clock_start < std::chrono::milliseconds(10));
+		const auto clock_end = std::chrono::steady_clock::now();
+		const uint64_t tsc_end = __rdtsc();
+
+		if (tsc_end <= tsc_start)
+			return false;
+
+		tsc_period = std::chrono::duration<double, std::nano>(clock_end - clock_start).count() / (tsc_end - tsc_start);
+		tsc = true;
+#else
+		(void) enable;
+#endif
+		return tsc;
+	}
+
+	void performance::set_precision(int bits) {
+		if (bits < 0 || histogram::max_precision < bits)
+			throw std::invalid_argument("Invalid histogram precision: " + std::to_string(bits));
+		std::lock_guard lock(shards_mutex);
+		if (!shards.empty())
+			throw std::runtime_error("Can't change the precision after timing has started");
+		precision = bits;
+	}
+
 #ifndef DISABLE_PERFORMANCE
-	void performance::start(const std::string &timer_name) {
-		timers[timer_name] = std::chrono::system_clock::now().time_since_epoch();
+	void performance::start(timer_handle handle) {
+		shard &local = local_shard();
+		shard::record &rec = local.get(handle);
+		if (rec.sampling_version != sampling_version.load(std::memory_order_relaxed))
+			refresh_sampling(local, handle);
+		rec.skipped = !local.sample(rec);
+		if (rec.skipped)
+			return;
+		// Counters are read before the clock on the way in and after it on the way out to keep them out of the time.
+		rec.started_mask = counting.load(std::memory_order_relaxed)? local.read_counters(rec.started_counters) : 0;
+		const uint64_t reading = now();
+		rec.started = reading;
+		trace(local, reading, handle, false);
 #else
-	void performance::start(const std::string &) {
+	void performance::start(timer_handle) {
 #endif
 	}
 
 #ifndef DISABLE_PERFORMANCE
-	performance::timetype performance::stop(const std::string &timer_name) {
-		std::chrono::system_clock::duration now = std::chrono::system_clock::now().time_since_epoch();
-		const auto diff = now - timers[timer_name];
-		totals[timer_name] += diff;
-		runs[timer_name].push_back(diff);
+	void performance::start(std::string_view timer_name) {
+		start(timer(timer_name));
+#else
+	void performance::start(std::string_view) {
+#endif
+	}
+
+#ifndef DISABLE_PERFORMANCE
+	performance::timetype performance::stop(timer_handle handle) {
+		shard &local = local_shard();
+		shard::record &rec = local.get(handle);
+		if (rec.skipped) {
+			rec.skipped = false;
+			return {};
+		}
+		const uint64_t reading = now();
+		const timetype diff = elapsed(rec.started, reading);
+		local.add(handle, diff.count());
+		if (rec.started_mask != 0)
+			local.add_counters(rec, rec.started_mask, rec.started_counters);
+		trace(local, reading, handle, true);
 		return diff;
 #else
-	performance::timetype performance::stop(const std::string &) {
+	performance::timetype performance::stop(timer_handle) {
 		return {};
 #endif
 	}
 
 #ifndef DISABLE_PERFORMANCE
-	bool performance::reset(const std::string &timer_name) {
-		const bool did_exist = 0 < timers.count(timer_name);
-		timers.erase(timer_name);
-		totals.erase(timer_name);
+	performance::timetype performance::stop(std::string_view timer_name) {
+		return stop(timer(timer_name));
+#else
+	performance::timetype performance::stop(std::string_view) {
+		return {};
+#endif
+	}
+
+	bool performance::enter(timer_handle handle) {
+		shard &local = local_shard();
+		shard::record &rec = local.get(handle);
+		if (rec.sampling_version != sampling_version.load(std::memory_order_relaxed))
+			refresh_sampling(local, handle);
+		if (!local.sample(rec))
+			return false;
+		const uint32_t node = local.find_node(handle, local.stack.empty()? shard::no_node : local.stack.back().node);
+		shard::frame &opened = local.stack.emplace_back(node, 0, 0);
+		opened.counter_mask = counting.load(std::memory_order_relaxed)? local.read_counters(opened.counters) : 0;
+		const uint64_t reading = now();
+		opened.started = reading;
+		trace(local, reading, handle, false);
+		return true;
+	}
+
+	void performance::refresh_sampling(shard &local, timer_handle handle) {
+		shard::record &rec = local.records[handle];
+		std::lock_guard lock(names_mutex);
+		rec.sampling_version = sampling_version.load(std::memory_order_relaxed);
+		const uint32_t interval = handle < sampling.size()? sampling[handle].first : 1;
+		const bool random = handle < sampling.size() && sampling[handle].second;
+		if (interval != rec.interval || random != rec.random) {
+			rec.interval = interval;
+			rec.random = random;
+			rec.countdown = local.next_countdown(rec);
+		}
+	}
+
+	void performance::set_sampling(timer_handle handle, uint32_t interval, bool random) {
+		if (interval == 0)
+			throw std::invalid_argument("Sampling interval must be at least 1");
+		std::lock_guard lock(names_mutex);
+		if (names.size() <= handle)
+			throw std::out_of_range("Invalid timer handle: " + std::to_string(handle));
+		if (sampling.size() <= handle)
+			sampling.resize(names.size(), {1, false});
+		sampling[handle] = {interval, random};
+		sampling_version.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	performance::timetype performance::leave(timer_handle handle, bool canceled) {
+		const uint64_t reading = now();
+		shard &local = local_shard();
+
+		// Watchers are normally destroyed in the reverse order of their creation. If one outlived a scope nested in
+		// it, that scope is abandoned; if it isn't on the stack at all (a copied watcher), there's nothing to do.
+		auto found = std::find_if(local.stack.rbegin(), local.stack.rend(), [&](const shard::frame &frame) {
+			return local.nodes[frame.node].handle == handle;
+		});
+		if (found == local.stack.rend())
+			return {};
+
+		const shard::frame closed = *found;
+		local.stack.erase(std::prev(found.base()), local.stack.end());
+		trace(local, reading, handle, true);
+		if (canceled)
+			return {};
+
+		const timetype diff = elapsed(closed.started, reading);
+		local.add(handle, diff.count());
+		if (closed.counter_mask != 0)
+			local.add_counters(local.records[handle], closed.counter_mask, closed.counters);
+
+		shard::scope_node &node = local.nodes[closed.node];
+		bump(node.count, 1);
+		bump(node.inclusive, diff.count());
+		if (node.parent != shard::no_node)
+			bump(local.nodes[node.parent].children, diff.count());
+		return diff;
+	}
+
+	void performance::restart(timer_handle handle) {
+		shard &local = local_shard();
+		for (auto iter = local.stack.rbegin(); iter != local.stack.rend(); ++iter) {
+			if (local.nodes[iter->node].handle == handle) {
+				iter->started = now();
+				return;
+			}
+		}
+	}
+
+#ifndef DISABLE_PERFORMANCE
+	bool performance::reset(timer_handle handle) {
+		std::lock_guard lock(shards_mutex);
+		bool did_exist = false;
+		for (const auto &ptr: shards) {
+			std::lock_guard shard_lock(ptr->mutex);
+			if (handle < ptr->records.size()) {
+				histogram &times = ptr->records[handle].times;
+				did_exist = did_exist || times.count() != 0;
+				times.clear();
+				ptr->records[handle].invocations.store(0, std::memory_order_relaxed);
+				for (size_t index = 0; index < counter_count; ++index) {
+					ptr->records[handle].counters[index].store(0, std::memory_order_relaxed);
+					ptr->records[handle].counted[index].store(0, std::memory_order_relaxed);
+				}
+			}
+
+			for (shard::scope_node &node: ptr->nodes) {
+				if (node.handle == handle) {
+					node.count.store(0, std::memory_order_relaxed);
+					node.inclusive.store(0, std::memory_order_relaxed);
+					node.children.store(0, std::memory_order_relaxed);
+				}
+			}
+		}
 		return did_exist;
 #else
-	bool performance::reset(const std::string &) {
+	bool performance::reset(timer_handle) {
 		return true;
 #endif
 	}
 
+	bool performance::reset(std::string_view timer_name) {
+		timer_handle handle;
+		{
+			std::lock_guard lock(names_mutex);
+			auto iter = handles.find(timer_name);
+			if (iter == handles.end())
+				return false;
+			handle = iter->second;
+		}
+		return reset(handle);
+	}
+
+	performance::timer_stats performance::stats(timer_handle handle) const {
+		timer_stats out;
+		for (const thread_stats &thread: stats_by_thread(handle))
+			out.merge(thread.stats);
+		return out;
+	}
+
+	std::vector<performance::thread_stats> performance::stats_by_thread(timer_handle handle) const {
+		std::vector<thread_stats> out;
+		std::lock_guard lock(shards_mutex);
+		for (const auto &ptr: shards) {
+			std::lock_guard shard_lock(ptr->mutex);
+			timer_stats collected = ptr->collect(handle);
+			if (collected.count != 0 || collected.invocations != 0)
+				out.push_back({ptr->thread, ptr->exited.load(std::memory_order_acquire), collected});
+		}
+		return out;
+	}
+
+	void performance::trace(shard &local, uint64_t reading, timer_handle handle, bool end) {
+		if (tracing.load(std::memory_order_relaxed))
+			local.trace(trace_capacity.load(std::memory_order_relaxed), reading, handle, end);
+	}
+
+	std::vector<counter> performance::enable_counters() {
+		std::vector<counter> out;
+#ifndef DISABLE_PERFORMANCE
+		shard &local = local_shard();
+		if (!local.counters_opened)
+			local.open_counters();
+		for (size_t index = 0; index < counter_count; ++index) {
+			if (local.counter_mask & (uint32_t(1) << index))
+				out.push_back(static_cast<counter>(index));
+		}
+		counting.store(!out.empty());
+#endif
+		return out;
+	}
+
+	void performance::disable_counters() {
+		counting.store(false);
+	}
+
+	void performance::enable_tracing(size_t events_per_thread) {
+		if (events_per_thread == 0)
+			throw std::invalid_argument("Trace rings must hold at least one event");
+		if (trace_capacity.load() == 0) {
+			trace_origin = now();
+			trace_capacity.store(events_per_thread);
+		}
+		tracing.store(true);
+	}
+
+	void performance::disable_tracing() {
+		tracing.store(false);
+	}
+
+	void performance::write_trace(std::ostream &stream) const {
+		std::vector<std::string> timer_names;
+		{
+			std::lock_guard lock(names_mutex);
+			timer_names.assign(names.begin(), names.end());
+		}
+
+		std::vector<std::pair<size_t, std::vector<std::pair<uint64_t, uint64_t>>>> threads;
+		{
+			std::lock_guard lock(shards_mutex);
+			for (const auto &ptr: shards) {
+				std::lock_guard shard_lock(ptr->mutex);
+				threads.emplace_back(ptr->thread, ptr->trace_events());
+			}
+		}
+
+		const int pid = getpid();
+		bool first = true;
+		stream << "{\"traceEvents\":[";
+
+		for (const auto &[thread, events]: threads) {
+			if (events.empty())
+				continue;
+
+			stream << (first? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":"
+			       << thread << ",\"args\":{\"name\":\"thread " << thread << "\"}}";
+			first = false;
+
+			// Begin and end events must nest. An end event closes the innermost open span for its timer along with
+			// any spans left open inside it; an end event with no open span is left over from an overwritten begin.
+			std::vector<timer_handle> open;
+			auto write_event = [&](uint64_t reading, timer_handle handle, bool end) {
+				const double microseconds = reading < trace_origin? 0.0 : elapsed(trace_origin, reading).count() / 1e3;
+				char timestamp[32];
+				snprintf(timestamp, sizeof(timestamp), "%.3f", microseconds);
+				stream << ",\n{\"name\":";
+				write_json_string(stream, handle < timer_names.size()? timer_names[handle] : "?");
+				stream << ",\"ph\":\"" << (end? 'E' : 'B') << "\",\"ts\":" << timestamp << ",\"pid\":" << pid
+				       << ",\"tid\":" << thread << "}";
+			};
+
+			for (const auto &[reading, event]: events) {
+				const timer_handle handle = event >> 1;
+				if ((event & 1) == 0) {
+					open.push_back(handle);
+					write_event(reading, handle, false);
+					continue;
+				}
+
+				auto found = std::find(open.rbegin(), open.rend(), handle);
+				if (found == open.rend())
+					continue;
+				while (open.back() != handle) {
+					write_event(reading, open.back(), true);
+					open.pop_back();
+				}
+				open.pop_back();
+				write_event(reading, handle, true);
+			}
+		}
+
+		stream << "\n],\"displayTimeUnit\":\"ns\"}\n";
+	}
+
+	std::vector<performance::scope_stats> performance::call_tree() const {
+		// Nodes are merged by their path through the tree. The merged nodes refer to each other by index until the
+		// end, because the pool they're in grows as they're found.
+		struct merged_node {
+			timer_handle handle;
+			uint64_t count = 0, inclusive = 0, children_time = 0;
+			std::vector<size_t> children;
+		};
+
+		std::vector<merged_node> pool;
+		std::vector<size_t> roots;
+
+		constexpr size_t no_parent = SIZE_MAX;
+		auto find_or_add = [&](size_t parent, timer_handle handle) -> size_t {
+			for (const size_t index: parent == no_parent? roots : pool[parent].children) {
+				if (pool[index].handle == handle)
+					return index;
+			}
+			pool.push_back({handle, 0, 0, 0, {}});
+			(parent == no_parent? roots : pool[parent].children).push_back(pool.size() - 1);
+			return pool.size() - 1;
+		};
+
+		{
+			std::lock_guard lock(shards_mutex);
+			for (const auto &ptr: shards) {
+				std::lock_guard shard_lock(ptr->mutex);
+				std::vector<size_t> merged_index(ptr->nodes.size());
+				for (size_t i = 0; i < ptr->nodes.size(); ++i) {
+					const shard::scope_node &node = ptr->nodes[i];
+					const size_t index = find_or_add(node.parent == shard::no_node? no_parent : merged_index[node.parent],
+						node.handle);
+					merged_index[i] = index;
+					pool[index].count         += node.count.load(std::memory_order_relaxed);
+					pool[index].inclusive     += node.inclusive.load(std::memory_order_relaxed);
+					pool[index].children_time += node.children.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		std::function<scope_stats(size_t)> convert = [&](size_t index) {
+			const merged_node &node = pool[index];
+			scope_stats out {node.handle, node.count, timetype(node.inclusive),
+				timetype(node.children_time < node.inclusive? node.inclusive - node.children_time : 0), {}};
+			for (const size_t child: node.children) {
+				if (pool[child].count != 0)
+					out.children.push_back(convert(child));
+			}
+			std::sort(out.children.begin(), out.children.end(), [](const scope_stats &a, const scope_stats &b) {
+				return a.inclusive > b.inclusive;
+			});
+			return out;
+		};
+
+		std::vector<scope_stats> out;
+		for (const size_t root: roots) {
+			if (pool[root].count != 0)
+				out.push_back(convert(root));
+		}
+		std::sort(out.begin(), out.end(), [](const scope_stats &a, const scope_stats &b) {
+			return a.inclusive > b.inclusive;
+		});
+		return out;
+	}
+
+	void performance::report_tree(const scope_stats &scope, const scope_stats *parent, size_t depth) const {
+		std::string line(depth * 2, ' ');
+		line += ansi::bold(get_name(scope.handle));
+		if (parent == nullptr) {
+			DBG(line << ": "_d << ansi::cyan(std::to_string(scope.count)) << " -> "_d << format_duration(scope.inclusive) << " (self " << format_duration(scope.self) << ")");
+		} else {
+			char percent[16];
+			snprintf(percent, sizeof(percent), "%.1f%%", parent->inclusive.count() == 0? 0.0
+				: 100.0 * scope.inclusive.count() / parent->inclusive.count());
+			DBG(line << ": "_d << ansi::cyan(std::to_string(scope.count)) << " -> "_d << format_duration(scope.inclusive) << " (self " << format_duration(scope.self) << ", " << ansi::magenta(percent) << " of parent)");
+		}
+
+		for (const scope_stats &child: scope.children)
+			report_tree(child, &scope, depth + 1);
+	}
+
+	performance::stats_snapshot performance::snapshot() const {
+		stats_snapshot out;
+		out.taken = std::chrono::steady_clock::now();
+		{
+			std::lock_guard lock(names_mutex);
+			out.timers.reserve(handles.size());
+			for (const auto &[name, handle]: handles)
+				out.timers.push_back({handle, name, {}});
+		}
+
+		std::sort(out.timers.begin(), out.timers.end(), [](const auto &a, const auto &b) { return a.name < b.name; });
+
+		// Lock each shard once and copy all of its timers together, rather than going through stats() per timer.
+		{
+			std::lock_guard lock(shards_mutex);
+			for (const auto &ptr: shards) {
+				std::lock_guard shard_lock(ptr->mutex);
+				for (stats_snapshot::entry &timer: out.timers)
+					timer.stats.merge(ptr->collect(timer.handle));
+			}
+		}
+
+		std::erase_if(out.timers, [](const stats_snapshot::entry &timer) {
+			return timer.stats.count == 0 && timer.stats.invocations == 0;
+		});
+		return out;
+	}
+
+	void performance::write_json(std::ostream &stream, const stats_snapshot &snap) {
+		stream << "{\"timers\":[";
+		bool first = true;
+		for (const stats_snapshot::entry &timer: snap.timers) {
+			const timer_stats &stats = timer.stats;
+			stream << (first? "\n" : ",\n") << "{\"name\":";
+			first = false;
+			write_json_string(stream, timer.name);
+			stream << ",\"count\":" << stats.count << ",\"invocations\":" << stats.invocations << ",\"total_ns\":"
+			       << stats.total.count() << ",\"min_ns\":" << stats.min.count() << ",\"max_ns\":" << stats.max.count()
+			       << ",\"mean_ns\":" << stats.mean().count() << ",\"p50_ns\":" << stats.percentile(50).count()
+			       << ",\"p90_ns\":" << stats.percentile(90).count() << ",\"p99_ns\":" << stats.percentile(99).count()
+			       << ",\"p999_ns\":" << stats.percentile(99.9).count() << ",\"counters\":{";
+
+			bool first_counter = true;
+			for (size_t index = 0; index < counter_count; ++index) {
+				if (stats.counted[index] == 0)
+					continue;
+				stream << (first_counter? "" : ",");
+				first_counter = false;
+				write_json_string(stream, counter_name(static_cast<counter>(index)));
+				stream << ":{\"total\":" << stats.counters[index] << ",\"counted\":" << stats.counted[index] << "}";
+			}
+
+			const histogram &distribution = stats.distribution;
+			stream << "},\"histogram\":{\"precision\":" << distribution.get_precision() << ",\"buckets\":[";
+			bool first_bucket = true;
+			for (size_t index = 0; index < distribution.bucket_count(); ++index) {
+				if (distribution.bucket(index) == 0)
+					continue;
+				stream << (first_bucket? "" : ",") << "[" << index << "," << distribution.bucket(index) << "]";
+				first_bucket = false;
+			}
+			stream << "]}}";
+		}
+		stream << "\n]}\n";
+	}
+
+	void performance::write_csv(std::ostream &stream, const stats_snapshot &snap) {
+		stream << "name,count,invocations,total_ns,mean_ns,min_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns";
+		for (size_t index = 0; index < counter_count; ++index) {
+			std::string column(counter_name(static_cast<counter>(index)));
+			std::replace(column.begin(), column.end(), ' ', '_');
+			stream << "," << column << "_per_call";
+		}
+		stream << "\n";
+
+		for (const stats_snapshot::entry &timer: snap.timers) {
+			const timer_stats &stats = timer.stats;
+			write_csv_field(stream, timer.name);
+			stream << "," << stats.count << "," << stats.invocations << "," << stats.total.count() << ","
+			       << stats.mean().count() << "," << stats.min.count() << "," << stats.percentile(50).count() << ","
+			       << stats.percentile(90).count() << "," << stats.percentile(99).count() << ","
+			       << stats.percentile(99.9).count() << "," << stats.max.count();
+			for (size_t index = 0; index < counter_count; ++index) {
+				stream << ",";
+				if (stats.counted[index] != 0) {
+					char per_call[32];
+					snprintf(per_call, sizeof(per_call), "%.6g", stats.per_call(static_cast<counter>(index)));
+					stream << per_call;
+				}
+			}
+			stream << "\n";
+		}
+	}
+
+	performance::stats_snapshot performance::read_json(std::istream &stream) {
+		const std::string input {std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>()};
+		const json_value root = json_parser(input).parse();
+		using kind = json_value::kind;
+
+		stats_snapshot out;
+		out.taken = std::chrono::steady_clock::now();
+		for (const json_value &item: root.at("timers", kind::array).items) {
+			if (item.type != kind::object)
+				throw std::runtime_error("Expected a JSON object for each timer");
+
+			stats_snapshot::entry timer {static_cast<timer_handle>(out.timers.size()), item.at("name", kind::string).text,
+				{}};
+			timer_stats &stats = timer.stats;
+			stats.count = item.at("count", kind::number).as_unsigned();
+			stats.invocations = item.at("invocations", kind::number).as_unsigned();
+			stats.total = timetype(item.at("total_ns", kind::number).as_unsigned());
+			stats.min = timetype(item.at("min_ns", kind::number).as_unsigned());
+			stats.max = timetype(item.at("max_ns", kind::number).as_unsigned());
+
+			if (const json_value *counters = item.get("counters")) {
+				for (const auto &[name, value]: counters->members) {
+					for (size_t index = 0; index < counter_count; ++index) {
+						if (name == counter_name(static_cast<counter>(index))) {
+							stats.counters[index] = value.at("total", kind::number).as_unsigned();
+							stats.counted[index] = value.at("counted", kind::number).as_unsigned();
+						}
+					}
+				}
+			}
+
+			// Each bucket's count is restored at its midpoint, except that the minimum and maximum are recorded
+			// exactly and the midpoints are clamped to them, so that percentiles are clamped as they were originally.
+			const json_value &hist = item.at("histogram", kind::object);
+			const uint64_t precision = hist.at("precision", kind::number).as_unsigned();
+			if (histogram::max_precision < precision)
+				throw std::runtime_error("Invalid histogram precision: " + std::to_string(precision));
+			histogram distribution(precision);
+			bool min_left = stats.count != 0, max_left = 1 < stats.count;
+			for (const json_value &pair: hist.at("buckets", kind::array).items) {
+				if (pair.type != kind::array || pair.items.size() != 2)
+					throw std::runtime_error("Expected an [index, count] pair for each histogram bucket");
+				const uint64_t index = pair.items[0].as_unsigned();
+				uint64_t times = pair.items[1].as_unsigned();
+				if (distribution.bucket_count() <= index)
+					throw std::runtime_error("Invalid histogram bucket: " + std::to_string(index));
+
+				const uint64_t min_ns = stats.min.count(), max_ns = stats.max.count();
+				if (min_left && times != 0 && distribution.index(min_ns) == index) {
+					distribution.record(min_ns);
+					--times;
+					min_left = false;
+				}
+				if (max_left && times != 0 && distribution.index(max_ns) == index) {
+					distribution.record(max_ns);
+					--times;
+					max_left = false;
+				}
+				const uint64_t lower = distribution.bucket_lower(index), upper = distribution.bucket_upper(index);
+				distribution.record(std::clamp(lower + (upper - lower) / 2, min_ns, std::max(min_ns, max_ns)), times);
+			}
+			stats.distribution = distribution;
+			out.timers.push_back(std::move(timer));
+		}
+
+		std::sort(out.timers.begin(), out.timers.end(), [](const auto &a, const auto &b) { return a.name < b.name; });
+		return out;
+	}
+
+	std::vector<performance::comparison> performance::compare(const stats_snapshot &baseline,
+	const stats_snapshot &current, double threshold, double alpha) {
+		std::vector<comparison> out;
+		for (const stats_snapshot::entry &timer: current.timers) {
+			auto found = std::find_if(baseline.timers.begin(), baseline.timers.end(), [&](const auto &entry) {
+				return entry.name == timer.name;
+			});
+			if (found == baseline.timers.end() || found->stats.count == 0 || timer.stats.count == 0)
+				continue;
+
+			const histogram &before = found->stats.distribution, &after = timer.stats.distribution;
+
+			// The histograms are merged into a list of distinct values with the count of each in either sample. Values
+			// in the same bucket are ties, which the test corrects for.
+			struct value_counts {
+				uint64_t value, before, after;
+			};
+			std::vector<value_counts> values;
+			for (const histogram *dist: {&before, &after}) {
+				for (size_t index = 0; index < dist->bucket_count(); ++index) {
+					const uint64_t count = dist->bucket(index);
+					if (count == 0)
+						continue;
+					const uint64_t lower = dist->bucket_lower(index), upper = dist->bucket_upper(index);
+					values.push_back({lower + (upper - lower) / 2, dist == &before? count : 0, dist == &after? count : 0});
+				}
+			}
+			std::sort(values.begin(), values.end(), [](const auto &a, const auto &b) { return a.value < b.value; });
+
+			// The rank sum of the current sample gives its U statistic, which is compared with its distribution under
+			// the null hypothesis by the normal approximation with a tie correction and a continuity correction.
+			double n_before = 0, n_after = 0, rank_sum = 0, ties = 0, seen = 0;
+			for (size_t i = 0; i < values.size();) {
+				double in_before = 0, in_after = 0;
+				const uint64_t value = values[i].value;
+				for (; i < values.size() && values[i].value == value; ++i) {
+					in_before += values[i].before;
+					in_after += values[i].after;
+				}
+				const double tied = in_before + in_after;
+				rank_sum += in_after * (seen + (tied + 1) / 2);
+				ties += tied * tied * tied - tied;
+				seen += tied;
+				n_before += in_before;
+				n_after += in_after;
+			}
+
+			const double total = n_before + n_after;
+			const double u = rank_sum - n_after * (n_after + 1) / 2;
+			const double variance = n_before * n_after / 12 * ((total + 1) - ties / (total * (total - 1)));
+			comparison result;
+			result.name = timer.name;
+			if (0 < variance)
+				result.p_value = 0.5 * std::erfc((u - n_before * n_after / 2 - 0.5) / std::sqrt(variance) / std::sqrt(2.0));
+
+			result.baseline_p50 = found->stats.percentile(50);
+			result.current_p50  = timer.stats.percentile(50);
+			result.baseline_p99 = found->stats.percentile(99);
+			result.current_p99  = timer.stats.percentile(99);
+			auto change = [](timetype from, timetype to) {
+				return from.count() == 0? 0.0 : static_cast<double>(to.count() - from.count()) / from.count();
+			};
+			result.p50_change = change(result.baseline_p50, result.current_p50);
+			result.p99_change = change(result.baseline_p99, result.current_p99);
+			result.regressed = result.p_value < alpha && (threshold < result.p50_change || threshold < result.p99_change);
+			out.push_back(std::move(result));
+		}
+		return out;
+	}
+
+	bool performance::report_comparisons(const std::vector<comparison> &comparisons) {
+		bool any = false;
+		for (const comparison &result: comparisons) {
+			char changes[96];
+			snprintf(changes, sizeof(changes), "p50 %+.1f%%, p99 %+.1f%%, p = %.3g", 100 * result.p50_change,
+				100 * result.p99_change, result.p_value);
+			const std::string detail = format_duration(result.baseline_p50) + " -> " + format_duration(result.current_p50)
+				+ " median, " + format_duration(result.baseline_p99) + " -> " + format_duration(result.current_p99) + " p99 ("
+				+ changes + ")";
+			if (result.regressed) {
+				DBG(ansi::bold(result.name) << ": "_d << ansi::red("regressed") << ": "_d << detail);
+			} else {
+				DBG(ansi::bold(result.name) << ": "_d << detail);
+			}
+			any = any || result.regressed;
+		}
+		return any;
+	}
+
+	void performance::start_reporter(ansi::ansistream &stream, std::chrono::milliseconds interval) {
+		stop_reporter();
+		reporter_stopping = false;
+		reporter = std::thread(&performance::run_reporter, this, std::ref(stream), interval);
+	}
+
+	void performance::stop_reporter() {
+		if (!reporter.joinable())
+			return;
+		{
+			std::lock_guard lock(reporter_mutex);
+			reporter_stopping = true;
+		}
+		reporter_wake.notify_all();
+		reporter.join();
+	}
+
+	void performance::run_reporter(ansi::ansistream &stream, std::chrono::milliseconds interval) {
+		stats_snapshot previous = snapshot();
+		std::unordered_map<timer_handle, timer_stats> previous_interval;
+		int lines = 0;
+
+		for (;;) {
+			{
+				std::unique_lock lock(reporter_mutex);
+				if (reporter_wake.wait_for(lock, interval, [this] { return reporter_stopping; }))
+					return;
+			}
+
+			const stats_snapshot current = snapshot();
+			const double seconds = std::chrono::duration<double>(current.taken - previous.taken).count();
+
+			// Compares a percentile with the same one from the interval before as a colored percentage.
+			auto change = [](timetype now, timetype before) -> std::string {
+				if (before.count() == 0 || now.count() == 0)
+					return std::string(8, ' ');
+				const double percent = 100.0 * (now.count() - before.count()) / before.count();
+				char buffer[16];
+				snprintf(buffer, sizeof(buffer), "%+7.1f%%", percent);
+				if (percent <= -5)
+					return ansi::wrap(buffer, ansi::color::green);
+				if (5 <= percent)
+					return ansi::wrap(buffer, ansi::color::red);
+				return buffer;
+			};
+
+			// Right-aligns a string to a number of columns, counting UTF-8 sequences as one column each.
+			auto pad = [](std::string str, size_t width) {
+				const size_t columns = std::count_if(str.begin(), str.end(), [](char ch) { return (ch & 0xc0) != 0x80; });
+				if (columns < width)
+					str.insert(0, width - columns, ' ');
+				return str;
+			};
+
+			stream.up(lines);
+			lines = 0;
+
+			stream << "\r";
+			stream.clear_line();
+			stream << ansi::style::bold << "timer" << std::string(23, ' ') << " " << pad("calls/s", 10) << " "
+			       << pad("p50", 10) << " " << pad("p90", 10) << " " << pad("p99", 10) << " " << pad("max", 10) << " "
+			       << pad("Δp50", 8) << " " << pad("Δp99", 8) << " " << pad("calls", 12) << ansi::action::end_line;
+			++lines;
+
+			std::unordered_map<timer_handle, timer_stats> this_interval;
+			for (const stats_snapshot::entry &timer: current.timers) {
+				const stats_snapshot::entry *before = previous.find(timer.handle);
+				const timer_stats recent = before? timer.stats.since(before->stats) : timer.stats;
+				const auto found = previous_interval.find(timer.handle);
+				const timer_stats *last = found == previous_interval.end()? nullptr : &found->second;
+
+				char rate[32];
+				snprintf(rate, sizeof(rate), "%.1f", seconds <= 0? 0.0 : recent.invocations / seconds);
+				std::string name = timer.name.substr(0, 28);
+				name.resize(28, ' ');
+
+				stream << "\r";
+				stream.clear_line();
+				stream << ansi::style::bold << name << ansi::remove(ansi::style::bold) << " " << pad(rate, 10) << " "
+				       << pad(format_duration(recent.percentile(50)), 10) << " "
+				       << pad(format_duration(recent.percentile(90)), 10) << " "
+				       << pad(format_duration(recent.percentile(99)), 10) << " "
+				       << pad(format_duration(recent.max), 10) << " "
+				       << change(recent.percentile(50), last? last->percentile(50) : timetype {}) << " "
+				       << change(recent.percentile(99), last? last->percentile(99) : timetype {}) << " "
+				       << pad(std::to_string(timer.stats.invocations), 12) << ansi::action::end_line;
+				++lines;
+
+				if (recent.count != 0)
+					this_interval.emplace(timer.handle, recent);
+				else if (last)
+					this_interval.emplace(timer.handle, *last);
+			}
+
+			stream.flush();
+			previous = current;
+			previous_interval = std::move(this_interval);
+		}
+	}
+
 	void performance::results() {
 #ifndef DISABLE_PERFORMANCE
-		for (const auto &pair: totals)
-			DBG(ansi::bold(pair.first) << ": "_d << ansi::cyan(std::to_string(runs[pair.first].size())) << " -> "_d << ansi::orange(std::to_string(pair.second.count())) << " μs (average: " << ansi::magenta(std::to_string(pair.second.count() / runs[pair.first].size())) << " μs)");
+		std::vector<std::pair<std::string, timer_handle>> order;
+		{
+			std::lock_guard lock(names_mutex);
+			order.reserve(handles.size());
+			for (const auto &pair: handles)
+				order.emplace_back(pair.first, pair.second);
+		}
+		std::sort(order.begin(), order.end());
+
+		for (const auto &[name, handle]: order) {
+			const std::vector<thread_stats> threads = stats_by_thread(handle);
+			if (threads.empty())
+				continue;
+
+			timer_stats merged;
+			for (const thread_stats &thread: threads)
+				merged.merge(thread.stats);
+			report(ansi::bold(name), merged);
+
+			if (1 < threads.size()) {
+				for (const thread_stats &thread: threads)
+					report("  thread " + std::to_string(thread.thread) + (thread.exited? " (exited)" : ""), thread.stats);
+			}
+		}
+
+		const std::vector<scope_stats> tree = call_tree();
+		if (!tree.empty()) {
+			DBG("Call tree:");
+			for (const scope_stats &root: tree)
+				report_tree(root, nullptr, 1);
+		}
+
 		DBG("Finished list.");
 #endif
 	}
 
-	watcher performance::watch(const std::string &timer_name) {
-		return watcher(timer_name, this);
+	watcher performance::watch(timer_handle handle) {
+		return watcher(handle, this);
+	}
+
+#ifndef DISABLE_PERFORMANCE
+	watcher performance::watch(std::string_view timer_name) {
+		return watch(timer(timer_name));
+#else
+	watcher performance::watch(std::string_view) {
+		return watch(0);
+#endif
 	}
 }
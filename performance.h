@@ -1,21 +1,146 @@
 #ifndef FORMICINE_PERFORMANCE_H_
 #define FORMICINE_PERFORMANCE_H_
 
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <istream>
 #include <functional>
+#include <memory>
+#include <ostream>
+#include <mutex>
 #include <string>
-#include <map>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#define FORMICINE_CONCAT_(a, b) a##b
+#define FORMICINE_CONCAT(a, b) FORMICINE_CONCAT_(a, b)
+
+#ifdef DISABLE_PERFORMANCE
+#define FORMICINE_SCOPE(name) static_assert(true, "")
+#else
+/** Times the rest of the enclosing scope with formicine::perf: FORMICINE_SCOPE("parse"). The name must be a constant
+ *  expression; its key is hashed at compile time and resolved to a handle through a lock-free table the first time the
+ *  line runs, so afterwards entering the scope costs no lookup and no allocation. Only the first resolution of a name
+ *  anywhere in the program takes a lock. Compiles to nothing when DISABLE_PERFORMANCE is defined. */
+#define FORMICINE_SCOPE(name) FORMICINE_SCOPE_(name, __COUNTER__)
+#define FORMICINE_SCOPE_(name, id) \
+	static const ::formicine::timer_handle FORMICINE_CONCAT(formicine_handle_, id) = ::formicine::perf.timer(name, \
+		std::integral_constant<uint64_t, ::formicine::timer_key(name)>::value); \
+	const ::formicine::watcher FORMICINE_CONCAT(formicine_watcher_, id)(FORMICINE_CONCAT(formicine_handle_, id), \
+		&::formicine::perf)
+#endif
+
+namespace ansi {
+	class ansistream;
+}
+
 namespace formicine {
 	class performance;
 
+	/** Identifies a timer interned by performance::timer(). */
+	using timer_handle = uint32_t;
+
+	/** Returns the 64-bit FNV-1a hash of a timer name, never 0, for performance::timer(std::string_view, uint64_t).
+	 *  Only usable at compile time. */
+	consteval uint64_t timer_key(std::string_view name) {
+		uint64_t hash = 0xcbf29ce484222325ull;
+		for (const char ch: name) {
+			hash ^= static_cast<unsigned char>(ch);
+			hash *= 0x100000001b3ull;
+		}
+		return hash == 0? 1 : hash;
+	}
+
+	/** An event counted per thread while timers run (see performance::enable_counters). The first four are hardware
+	 *  events counted in user space only; the last two are kernel events. */
+	enum class counter {cycles, instructions, cache_misses, branch_misses, context_switches, page_faults};
+	constexpr size_t counter_count = 6;
+
+	/** Returns a counter's name, e.g. "cache misses". */
+	std::string_view counter_name(counter);
+
+	/**
+	 * A log-linear histogram of nanosecond durations in the style of HdrHistogram. Values below 2^precision get a bucket
+	 * each, and each power of two above that is split into 2^precision equal buckets, so any value is recorded to within
+	 * a relative error of 2^-precision. Values of 2^40 ns (about 18 minutes) or more share the last bucket, although
+	 * the exact maximum is kept. At the default precision of 4 bits, a histogram takes under 5 KB. Buckets are relaxed
+	 * atomics: one thread can record while others read, merge or copy it. Each record is written under a sequence lock,
+	 * so a copy's count, sum and buckets agree with each other. If the copy keeps overlapping records, it gives up
+	 * after a few attempts and takes its count from the copied buckets; its sum may then be off by those records.
+	 */
+	class histogram {
+		public:
+			static constexpr int default_precision = 4;
+			static constexpr int max_precision = 10;
+			static constexpr int range_bits = 40;
+
+			histogram(int precision = default_precision);
+			histogram(const histogram &);
+			histogram & operator=(const histogram &);
+
+			void record(uint64_t);
+			/** Records the same value a number of times. */
+			void record(uint64_t value, uint64_t times);
+			/** Returns a histogram of the values recorded since an earlier copy of this one was taken. Its minimum and
+			 *  maximum are estimated from its buckets unless the maximum was recorded since. */
+			histogram since(const histogram &earlier) const;
+			/** Adds another histogram's counts to this one. An empty histogram takes on the other's precision;
+			 *  otherwise, the precisions must match. */
+			void merge(const histogram &);
+			void clear();
+
+			uint64_t count() const { return total_count.load(std::memory_order_relaxed); }
+			uint64_t sum()   const { return total_sum.load(std::memory_order_relaxed); }
+			uint64_t min()   const;
+			uint64_t max()   const { return maximum.load(std::memory_order_relaxed); }
+			int get_precision() const { return precision; }
+
+			/** Returns the value below which a given fraction of the recorded values fall, e.g. 0.99 for p99: the
+			 *  midpoint of the bucket that holds it, clamped to the recorded minimum and maximum. */
+			uint64_t value_at(double quantile) const;
+
+			size_t bucket_count() const { return size; }
+			uint64_t bucket(size_t index) const { return buckets[index].load(std::memory_order_relaxed); }
+			/** Returns the smallest value that falls in a bucket. */
+			uint64_t bucket_lower(size_t) const;
+			/** Returns the largest value that falls in a bucket. */
+			uint64_t bucket_upper(size_t) const;
+			/** Returns the index of the bucket a value falls in. */
+			size_t index(uint64_t) const;
+
+		private:
+			int precision;
+			size_t size;
+			std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+			std::atomic<uint64_t> total_count = 0;
+			std::atomic<uint64_t> total_sum = 0;
+			std::atomic<uint64_t> minimum = UINT64_MAX;
+			std::atomic<uint64_t> maximum = 0;
+			/** Odd while a value is being recorded. */
+			std::atomic<uint64_t> sequence = 0;
+
+			/** Copies another histogram of the same precision, which may be being recorded into. */
+			void copy(const histogram &);
+	};
+
+	/** Times a scope. Watchers nest: each one is recorded under the watcher that encloses it on the same thread, which
+	 *  builds the call tree reported by performance::results(). */
 	struct watcher {
-		std::string name;
+		timer_handle handle;
 		performance *parent;
 		bool canceled = false;
+		/** Whether this invocation of the timer was chosen by sampling (see performance::set_sampling). */
+		bool sampled = false;
 
-		watcher(const std::string &, performance *);
+		watcher(timer_handle, performance *);
 		watcher(const watcher &) = default;
 		~watcher();
 
@@ -26,20 +151,204 @@ namespace formicine {
 	 * Contains utilities for measuring performance of specific blocks of code.
 	 */
 	class performance {
-		using timetype = std::chrono::system_clock::duration;
+		public:
+			using timetype = std::chrono::nanoseconds;
+
+			/** Statistics for a timer, from one thread or merged from several. */
+			struct timer_stats {
+				/** The number of invocations that were measured. */
+				uint64_t count = 0;
+				/** The number of invocations, whether they were sampled or not. */
+				uint64_t invocations = 0;
+				timetype total {}, min {}, max {};
+				histogram distribution;
+
+				timetype mean() const { return count == 0? timetype {} : total / static_cast<timetype::rep>(count); }
+				/** The fraction of invocations that were measured. */
+				double sampling_rate() const { return invocations == 0? 1.0 : static_cast<double>(count) / invocations; }
+				/** The total time extrapolated from the measured invocations to all of them. */
+				timetype estimated_total() const { return count == 0? timetype {} : timetype(static_cast<timetype::rep>(
+					static_cast<double>(total.count()) * invocations / count)); }
+				/** Returns a percentile, e.g. 99.9 for p99.9. */
+				timetype percentile(double) const;
+				void merge(const timer_stats &);
+				/** Returns the statistics for what was recorded since an earlier snapshot of the same timer. */
+				timer_stats since(const timer_stats &earlier) const;
+
+				/** The totals of each counter over the measured invocations it was read for, indexed by counter. */
+				std::array<uint64_t, counter_count> counters {};
+				/** The number of measured invocations each counter was read for. */
+				std::array<uint64_t, counter_count> counted {};
+
+				/** Returns whether a counter was read for any invocation. */
+				bool has(counter which) const { return counted[static_cast<size_t>(which)] != 0; }
+				/** Returns a counter's average per measured invocation, or 0 if it was never read. */
+				double per_call(counter) const;
+				/** Returns the instructions retired per cycle, or 0 if the hardware counters weren't available. */
+				double ipc() const;
+			};
+
+			/** The statistics of every timer at one point in time, in name order. */
+			struct stats_snapshot {
+				struct entry {
+					timer_handle handle;
+					std::string name;
+					timer_stats stats;
+				};
+
+				std::chrono::steady_clock::time_point taken;
+				std::vector<entry> timers;
+
+				/** Returns the entry for a timer, or nullptr if it had no data. */
+				const entry * find(timer_handle) const;
+			};
+
+			/** How a timer's durations compare with a baseline's (see compare()). */
+			struct comparison {
+				std::string name;
+				timetype baseline_p50 {}, current_p50 {}, baseline_p99 {}, current_p99 {};
+				/** The relative changes in the percentiles, e.g. 0.1 for 10% slower. */
+				double p50_change = 0, p99_change = 0;
+				/** The one-sided p-value of a Mann-Whitney U test of whether the current durations tend to be longer
+				 *  than the baseline's. */
+				double p_value = 1;
+				/** Whether the difference is significant and the median or p99 grew by more than the threshold. */
+				bool regressed = false;
+			};
+
+			/** A node in the call tree: a timer reached through a particular chain of enclosing watchers. */
+			struct scope_stats {
+				timer_handle handle;
+				uint64_t count = 0;
+				/** The time spent in the scope, including the scopes nested in it. */
+				timetype inclusive {};
+				/** The time spent in the scope itself, outside any nested scope. */
+				timetype self {};
+				/** Sorted by inclusive time, longest first. */
+				std::vector<scope_stats> children;
+			};
+
+			/** A timer's statistics from a single thread. */
+			struct thread_stats {
+				/** Threads are numbered in the order they first used a timer, starting at 1. */
+				size_t thread;
+				/** Whether the thread has exited. */
+				bool exited;
+				timer_stats stats;
+			};
 
 		private:
-			/** Maps timer names to the times they were started. */
-			std::map<std::string, timetype> timers = {};
+			/** Each thread records its timings in its own shard, so timing never takes a lock; defined in
+			 *  performance.cpp. */
+			struct shard;
+
+			/** Distinguishes performance objects in the thread-local shard lookup. */
+			const uint64_t id;
+
+			/** Guards handles and names. */
+			mutable std::mutex names_mutex;
+
+			/** Lets handles be looked up by string_view without constructing a string. */
+			struct name_hash {
+				using is_transparent = void;
+				size_t operator()(std::string_view str) const { return std::hash<std::string_view>()(str); }
+			};
+
+			/** Maps timer names to their handles. */
+			std::unordered_map<std::string, timer_handle, name_hash, std::equal_to<>> handles = {};
+
+			/** The names of the timers, indexed by handle. A deque keeps references to them stable. */
+			std::deque<std::string> names = {};
+
+			/** An entry in the table of timers looked up by key. The name and handle are written before the key is
+			 *  published, and never change afterwards. */
+			struct keyed_timer {
+				std::atomic<uint64_t> key = 0;
+				std::atomic<const std::string *> name = nullptr;
+				std::atomic<timer_handle> handle = 0;
+			};
+
+			static constexpr size_t keyed_capacity = 1024;
+
+			/** Timers looked up by key, placed by linear probing. Entries are only added, with names_mutex held; once
+			 *  the table is full, further keyed lookups fall back to timer(std::string_view). */
+			std::array<keyed_timer, keyed_capacity> keyed = {};
+
+			/** The sampling interval and whether sampling is random for each timer that has been configured, indexed by
+			 *  handle. Guarded by names_mutex. */
+			std::vector<std::pair<uint32_t, bool>> sampling = {};
+
+			/** Incremented whenever sampling is reconfigured, so that shards know to pick up the change. */
+			std::atomic<uint64_t> sampling_version = 0;
 
-			/** Maps timer names to a list of times they've taken. */
-			std::map<std::string, std::vector<timetype>> runs = {};
+			/** Guards shards. */
+			mutable std::mutex shards_mutex;
 
-			/** Maps timer names to the total amount of time they've taken. */
-			std::map<std::string, timetype> totals = {};
+			/** Every shard that has been created, including those of threads that have since exited. */
+			std::vector<std::shared_ptr<shard>> shards = {};
+
+			/** Returns the calling thread's shard, creating it if necessary. */
+			shard & local_shard();
+
+			/** Brings a shard's copy of a timer's sampling configuration up to date. */
+			void refresh_sampling(shard &, timer_handle);
+
+			friend struct watcher;
+
+			/** Opens a scope for a timer on the calling thread's scope stack, unless sampling skips this invocation.
+			 *  Returns whether the scope was opened. */
+			bool enter(timer_handle);
+
+			/** Closes the innermost scope for a timer, closing any scopes left open inside it, and returns the time it
+			 *  took. Records it unless canceled is true. */
+			timetype leave(timer_handle, bool canceled = false);
+
+			/** Restarts the clock for the innermost scope for a timer. */
+			void restart(timer_handle);
+
+			/** Displays a node of the call tree and the nodes under it. */
+			void report_tree(const scope_stats &, const scope_stats *parent, size_t depth) const;
+
+			/** The precision of the timers' histograms. */
+			int precision = histogram::default_precision;
+
+			/** Whether the clock is read from the CPU's timestamp counter instead of std::chrono::steady_clock. */
+			bool tsc = false;
+
+			/** The number of nanoseconds per timestamp counter tick, as calibrated by use_tsc(). */
+			double tsc_period = 1.0;
+
+			/** Whether start, stop and watchers record trace events. */
+			std::atomic<bool> tracing = false;
+
+			/** The number of events each thread's trace ring holds. */
+			std::atomic<size_t> trace_capacity = 0;
+
+			/** The clock reading that trace timestamps are relative to. */
+			uint64_t trace_origin = 0;
+
+			/** Whether start, stop and watchers read the calling thread's counters. */
+			std::atomic<bool> counting = false;
+
+			std::thread reporter;
+			std::mutex reporter_mutex;
+			std::condition_variable reporter_wake;
+			bool reporter_stopping = false;
+
+			/** Renders the dashboard every interval until stop_reporter() is called. */
+			void run_reporter(ansi::ansistream &, std::chrono::milliseconds interval);
+
+			/** Records a trace event on the calling thread if tracing is enabled. */
+			void trace(shard &, uint64_t reading, timer_handle, bool end);
+
+			/** Returns the current clock reading in ticks of whichever clock is in use. */
+			uint64_t now() const;
+
+			/** Converts a difference between two clock readings to a duration. */
+			timetype elapsed(uint64_t from, uint64_t to) const;
 
 		public:
-			performance() = default;
+			performance();
 			performance(const performance &) = delete;
 			performance(performance &&) = delete;
 			performance & operator=(const performance &) = delete;
@@ -47,26 +356,142 @@ namespace formicine {
 
 			~performance();
 
+			/** Returns the handle for a timer name, creating the timer if it doesn't exist yet. Handles stay valid for
+			 *  the lifetime of the performance object. Each thread caches the names it has looked up, so only its
+			 *  first lookup of a name takes a lock. */
+			timer_handle timer(std::string_view);
+
+			/** Returns the handle for a timer name given its timer_key(), creating the timer if it doesn't exist yet.
+			 *  Once any thread has looked up the name this way, further lookups take no lock and don't hash the
+			 *  name. Keys are only used to find candidates, so names whose keys collide still get their own timers. */
+			timer_handle timer(std::string_view, uint64_t key);
+
+			/** Returns the name of a timer. */
+			const std::string & get_name(timer_handle) const;
+
+			/** Times with the CPU's timestamp counter, calibrated against std::chrono::steady_clock, if it's invariant.
+			 *  Returns whether the timestamp counter is in use. Call this before starting any timers. */
+			bool use_tsc(bool = true);
+
+			/** Measures only some invocations of a timer: one in every interval invocations or, if random is true,
+			 *  each invocation with a probability of 1/interval, chosen by a per-thread generator. Skipped invocations
+			 *  only bump a counter, and the statistics are extrapolated from the measured ones. Scopes nested in a
+			 *  skipped watcher are attributed to the nearest measured scope around it. An interval of 1 measures every
+			 *  invocation. */
+			void set_sampling(timer_handle, uint32_t interval, bool random = false);
+
+			/** Sets the precision in bits of the timers' histograms (see histogram). Throws std::runtime_error if any
+			 *  thread has started timing already. */
+			void set_precision(int);
+
 			/** Starts a timer. */
-			void start(const std::string &);
+			void start(timer_handle);
+			void start(std::string_view);
+
+			/** Stops a timer started on the same thread and returns the amount of time that elapsed. */
+			timetype stop(timer_handle);
+			timetype stop(std::string_view);
+
+			/** Removes all data about a timer from every thread. Returns true if anything was found and removed. */
+			bool reset(timer_handle);
+			bool reset(std::string_view);
+
+			/** Returns a timer's statistics merged across all threads, including those that have exited. */
+			timer_stats stats(timer_handle) const;
+
+			/** Returns a timer's statistics for each thread that has used it. */
+			std::vector<thread_stats> stats_by_thread(timer_handle) const;
+
+			/** Starts reading counters with perf_event_open when timers start and stop, so that their statistics
+			 *  include the events counted while they ran. Each thread opens its counters the first time it starts a
+			 *  timer. Counters the kernel won't open are left out: hardware counters are often unavailable in virtual
+			 *  machines and containers, and context switches and page faults then fall back to getrusage. Returns the
+			 *  counters available on the calling thread; if there are none (or this isn't Linux), counting stays
+			 *  disabled. Reading counters costs a system call at each start and stop. */
+			std::vector<counter> enable_counters();
+
+			/** Stops reading counters. The counts recorded so far are kept. */
+			void disable_counters();
+
+			/** Starts recording begin and end events for start, stop and watchers. Each thread records into its own ring
+			 *  of a given number of events, allocated when it first records one; when a ring is full, the oldest
+			 *  events are overwritten, so tracing can be left enabled indefinitely. */
+			void enable_tracing(size_t events_per_thread = 65536);
+
+			/** Stops recording trace events. The events recorded so far are kept for write_trace(). */
+			void disable_tracing();
 
-			/** Stops a timer and returns the amount of time that elapsed. */
-			timetype stop(const std::string &);
+			/** Writes the trace events currently held in all threads' rings as Chrome Trace Event JSON, which can be
+			 *  loaded in Perfetto or about:tracing. Safe to call while other threads are still recording. End events
+			 *  whose begin events have been overwritten are dropped. */
+			void write_trace(std::ostream &) const;
 
-			/** Removes all data about a timer. Returns true if anything was found and removed. */
-			bool reset(const std::string &);
+			/** Returns the statistics of every timer that has data, merged across threads. Timing continues on other
+			 *  threads while the snapshot is taken. Each thread's histogram for a timer is copied consistently (see
+			 *  histogram), but its invocations and counters are read separately, so they may include a measurement that
+			 *  the histogram doesn't yet, and different timers are read at slightly different times. */
+			stats_snapshot snapshot() const;
 
-			/** Displays all results so far. */
+			/** Writes a snapshot as JSON: for each timer, its counts, total, extremes, percentiles and counters, and the
+			 *  nonzero buckets of its histogram, which read_json() needs to restore the distribution. Durations are in
+			 *  nanoseconds. */
+			static void write_json(std::ostream &, const stats_snapshot &);
+			void write_json(std::ostream &stream) const { write_json(stream, snapshot()); }
+
+			/** Writes a snapshot as CSV with a header row and a row per timer. Counter columns hold the average per
+			 *  call and are empty for counters that weren't read. */
+			static void write_csv(std::ostream &, const stats_snapshot &);
+			void write_csv(std::ostream &stream) const { write_csv(stream, snapshot()); }
+
+			/** Reads a snapshot written by write_json(), e.g. a stored baseline. The handles in the snapshot are just
+			 *  its timers' positions, so match timers by name. Throws std::runtime_error if the JSON is malformed. */
+			static stats_snapshot read_json(std::istream &);
+
+			/** Compares the timers present in both snapshots, in name order. A timer is flagged as regressed if a
+			 *  Mann-Whitney U test on the two histograms finds the current durations longer at the given significance
+			 *  level and its median or p99 grew by more than the threshold, e.g. 0.05 for 5%. */
+			static std::vector<comparison> compare(const stats_snapshot &baseline, const stats_snapshot &current,
+				double threshold = 0.05, double alpha = 0.01);
+
+			/** Displays comparisons, highlighting regressions. Returns whether there were any. */
+			static bool report_comparisons(const std::vector<comparison> &);
+
+			/** Starts a background thread that renders a table of every timer to an ansistream at an interval,
+			 *  redrawing it in place: calls per second, percentiles over the last interval, and how the percentiles
+			 *  changed from the interval before. Nothing else should write to the stream in the meantime unless it's
+			 *  in concurrent mode. Replaces any reporter that's already running. */
+			void start_reporter(ansi::ansistream &, std::chrono::milliseconds interval = std::chrono::seconds(1));
+
+			/** Stops the background reporter, if it's running. */
+			void stop_reporter();
+
+			/** Returns the call tree of watcher scopes merged across all threads, as a list of top-level scopes. */
+			std::vector<scope_stats> call_tree() const;
+
+			/** Displays all results so far, merged across threads and broken down by thread where more than one
+			 *  thread used a timer, followed by the call tree. */
 			void results();
 
-			/** Returns a watcher for a given timer name. It starts a timer on creation and stops it on destruction. */
-			watcher watch(const std::string &);
-		
-			template <typename R, typename... Args>
-			timetype operator()(const std::string &timer_name, std::function<R(Args...)> fn, Args && ...args) {
-				start(timer_name);
-				fn(args...);
-				return stop(timer_name);
+			/** Returns a watcher for a given timer. It starts a timer on creation and stops it on destruction. */
+			watcher watch(timer_handle);
+			watcher watch(std::string_view);
+
+			/** Calls a function with the given arguments under a timer and returns the time it took. */
+			template <typename F, typename... Args>
+			timetype operator()(std::string_view timer_name, F &&fn, Args && ...args) {
+#ifdef DISABLE_PERFORMANCE
+				(void) timer_name;
+				std::invoke(std::forward<F>(fn), std::forward<Args>(args)...);
+				return {};
+#else
+				const timer_handle handle = timer(timer_name);
+				if (!enter(handle)) {
+					std::invoke(std::forward<F>(fn), std::forward<Args>(args)...);
+					return {};
+				}
+				std::invoke(std::forward<F>(fn), std::forward<Args>(args)...);
+				return leave(handle);
+#endif
 			}
 	};
 
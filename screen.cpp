@@ -0,0 +1,185 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "screen.h"
+
+namespace ansi {
+	namespace {
+		/** Encodes a code point as UTF-8 and returns the number of bytes written. */
+		size_t encode_utf8(char32_t ch, char *out) {
+			if (ch < 0x80) {
+				out[0] = static_cast<char>(ch);
+				return 1;
+			}
+
+			if (ch < 0x800) {
+				out[0] = static_cast<char>(0xc0 | (ch >> 6));
+				out[1] = static_cast<char>(0x80 | (ch & 0x3f));
+				return 2;
+			}
+
+			if (ch < 0x10000) {
+				out[0] = static_cast<char>(0xe0 | (ch >> 12));
+				out[1] = static_cast<char>(0x80 | ((ch >> 6) & 0x3f));
+				out[2] = static_cast<char>(0x80 | (ch & 0x3f));
+				return 3;
+			}
+
+			out[0] = static_cast<char>(0xf0 | (ch >> 18));
+			out[1] = static_cast<char>(0x80 | ((ch >> 12) & 0x3f));
+			out[2] = static_cast<char>(0x80 | ((ch >> 6) & 0x3f));
+			out[3] = static_cast<char>(0x80 | (ch & 0x3f));
+			return 4;
+		}
+
+		/** Returns whether a code point can be drawn in a cell: not a control character, surrogate or out of range. */
+		bool printable(char32_t ch) {
+			return 0x20 <= ch && !(0x7f <= ch && ch < 0xa0) && !(0xd800 <= ch && ch < 0xe000) && ch < 0x110000;
+		}
+
+		/** Decodes the UTF-8 sequence at the start of a string and removes it. Invalid bytes decode to U+FFFD. */
+		char32_t decode_utf8(std::string_view &str) {
+			const unsigned char first = str[0];
+			size_t length = 1;
+			char32_t ch = first;
+			if (0xf0 <= first && first < 0xf8) {
+				length = 4;
+				ch = first & 0x07;
+			} else if (0xe0 <= first) {
+				length = 3;
+				ch = first & 0x0f;
+			} else if (0xc0 <= first) {
+				length = 2;
+				ch = first & 0x1f;
+			} else if (0x80 <= first) {
+				str.remove_prefix(1);
+				return U'\ufffd';
+			}
+
+			if (str.size() < length) {
+				str.remove_prefix(str.size());
+				return U'\ufffd';
+			}
+
+			for (size_t i = 1; i < length; ++i) {
+				const unsigned char next = str[i];
+				if ((next & 0xc0) != 0x80) {
+					str.remove_prefix(i);
+					return U'\ufffd';
+				}
+				ch = (ch << 6) | (next & 0x3f);
+			}
+
+			str.remove_prefix(length);
+			return ch;
+		}
+	}
+
+	screen::screen(ansistream &stream_, int width_, int height_): stream(stream_) {
+		resize(width_, height_);
+	}
+
+	void screen::resize(int width_, int height_) {
+		if (width_ < 0 || height_ < 0)
+			throw std::invalid_argument("Invalid screen size: " + std::to_string(width_) + "x" + std::to_string(height_));
+		width = width_;
+		height = height_;
+		back.assign(width * height, cell {});
+		front.assign(width * height, cell {});
+		invalidate();
+	}
+
+	void screen::clear(const cell &fill) {
+		std::fill(back.begin(), back.end(), fill);
+	}
+
+	void screen::set(int x, int y, const cell &new_cell) {
+		if (0 <= x && x < width && 0 <= y && y < height)
+			at(x, y) = new_cell;
+	}
+
+	const cell & screen::get(int x, int y) const {
+		if (x < 0 || width <= x || y < 0 || height <= y)
+			throw std::out_of_range("Invalid cell: (" + std::to_string(x) + ", " + std::to_string(y) + ")");
+		return back[y * width + x];
+	}
+
+	int screen::write(int x, int y, std::string_view text, const sgr_state &attributes) {
+		if (y < 0 || height <= y)
+			return 0;
+
+		int written = 0;
+		for (; !text.empty() && x < width; ++x) {
+			const char32_t glyph = decode_utf8(text);
+			if (0 <= x) {
+				at(x, y) = {glyph, attributes};
+				++written;
+			}
+		}
+
+		return written;
+	}
+
+	void screen::invalidate() {
+		front_valid = false;
+	}
+
+	void screen::move_cursor(int x, int y) {
+		if (cursor_x == x && cursor_y == y)
+			return;
+
+		if (cursor_y == y && 0 <= cursor_x) {
+			if (x == 0)
+				stream << "\r";
+			else if (cursor_x < x)
+				stream.right(x - cursor_x);
+			else
+				stream.left(cursor_x - x);
+		} else if (x == 0 && 0 <= cursor_y && y == cursor_y + 1) {
+			stream << "\r\n";
+		} else {
+			stream.jump(x, y);
+		}
+
+		cursor_x = x;
+		cursor_y = y;
+	}
+
+	size_t screen::present() {
+		if (!front_valid) {
+			// Start from a blank terminal so that only cells that aren't blank need to be drawn.
+			stream << sgr_state {};
+			stream.clear();
+			std::fill(front.begin(), front.end(), cell {});
+			cursor_x = cursor_y = -1;
+			front_valid = true;
+		}
+
+		size_t changed = 0;
+		char encoded[5] {};
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				const cell &next = back[y * width + x];
+				cell &current = front[y * width + x];
+				if (next == current)
+					continue;
+
+				move_cursor(x, y);
+				stream << next.attributes;
+				// Anything else would move the cursor differently or not at all, so the tracked position would drift.
+				encoded[encode_utf8(printable(next.glyph)? next.glyph : U' ', encoded)] = '\0';
+				stream << encoded;
+				current = next;
+				++changed;
+
+				// After writing to the last column, terminals differ on where the cursor ends up.
+				if (++cursor_x == width)
+					cursor_x = cursor_y = -1;
+			}
+		}
+
+		stream.flush();
+		return changed;
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef FORMICINE_SCREEN_H_
+#define FORMICINE_SCREEN_H_
+
+#include <string_view>
+#include <vector>
+
+#include "ansi.h"
+
+namespace ansi {
+	/** A single character cell on a screen. */
+	struct cell {
+		char32_t glyph = U' ';
+		sgr_state attributes;
+
+		bool operator==(const cell &) const = default;
+	};
+
+	/**
+	 * A double-buffered grid of cells drawn through an ansistream. Drawing functions only change the back buffer;
+	 * present() then writes just the cells that differ from what's on the terminal. Every glyph is assumed to be one
+	 * column wide; control characters and invalid code points are drawn as spaces. The stream's content and style
+	 * output should go to the same place, either because both streams are the same or because buffering is enabled.
+	 */
+	class screen {
+		private:
+			ansistream &stream;
+			int width, height;
+			std::vector<cell> back, front;
+			/** Whether the front buffer matches what's on the terminal. */
+			bool front_valid = false;
+			/** The cursor position, if it's known. */
+			int cursor_x = -1, cursor_y = -1;
+
+			cell & at(int x, int y) { return back[y * width + x]; }
+			void move_cursor(int x, int y);
+
+		public:
+			screen(ansistream &, int width, int height);
+
+			int get_width()  const { return width; }
+			int get_height() const { return height; }
+
+			/** Resizes both buffers. The back buffer is cleared and the next present() redraws everything. */
+			void resize(int width, int height);
+
+			/** Fills the back buffer with a cell. */
+			void clear(const cell & = {});
+
+			/** Sets a cell in the back buffer. Positions outside the screen are ignored. */
+			void set(int x, int y, const cell &);
+
+			/** Returns a cell from the back buffer. */
+			const cell & get(int x, int y) const;
+
+			/** Writes UTF-8 text into the back buffer starting at a position, clipped at the end of the row. Returns
+			 *  the number of cells written. */
+			int write(int x, int y, std::string_view, const sgr_state & = {});
+
+			/** Makes the next present() clear the terminal and redraw every cell. */
+			void invalidate();
+
+			/** Writes every cell that differs from the terminal, then flushes the stream. Returns the number of cells
+			 *  written. */
+			size_t present();
+	};
+}
+
+#endif
@@ -17,4 +17,7 @@ int main(int, char **) {
 	   << " red" << ansi::action::reset << "\n";
 	as << "Normal " << ansi::wrap("bold", ansi::style::bold) << " not bold\n";
 	as << "Bold "_b << "italic "_i << "underlined"_u << " dim "_d << "bold+dim"_bd << "\n";
+	as << "^b^[red]Bold red^0 and ^[:blue!]^[white]white on bright blue^0 from a compile-time template.\n"_fmt;
+	as << "^[:green]Green background^[:normal] then the default background.\n"_fmt;
+	as << ansi::format("^[:green]Green background^[:normal] then the default background, formatted at runtime.\n");
 }
@@ -0,0 +1,85 @@
+// Checks that the *_to functions don't allocate when the destination has room.
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <span>
+#include <string>
+
+#include "ansi.h"
+
+namespace {
+	size_t allocations = 0;
+	int failures = 0;
+
+	void check(bool condition, const char *what) {
+		if (!condition) {
+			std::fprintf(stderr, "FAILED: %s\n", what);
+			++failures;
+		}
+	}
+
+	/** Runs a function and returns how many allocations it made. */
+	template <typename Fn>
+	size_t count_allocations(Fn &&fn) {
+		const size_t before = allocations;
+		fn();
+		return allocations - before;
+	}
+}
+
+void * operator new(size_t size) {
+	++allocations;
+	if (void *ptr = std::malloc(size == 0? 1 : size))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+	std::free(ptr);
+}
+
+int main() {
+	const std::string_view formatted = "^b^[red]Bold red^0 and ^[:blue!]^[white]white on bright blue^0.";
+	const std::string_view styled = "\e[1mbold\e[22m and \e[31mred\e[39m text";
+	const ansi::color_pair pair = ansi::fg(ansi::color::green);
+
+	std::string out;
+	out.reserve(4096);
+	check(count_allocations([&] { ansi::format_to(out, formatted); }) == 0, "format_to into a reserved string");
+	check(out == ansi::format(formatted), "format_to output");
+	out.clear();
+	check(count_allocations([&] { ansi::strip_to(out, styled); }) == 0, "strip_to into a reserved string");
+	check(out == ansi::strip(styled), "strip_to output");
+	out.clear();
+	check(count_allocations([&] { ansi::wrap_to(out, "text", pair); }) == 0, "wrap_to(pair) into a reserved string");
+	check(out == ansi::wrap("text", pair), "wrap_to(pair) output");
+	out.clear();
+	check(count_allocations([&] { ansi::wrap_to(out, "text", ansi::style::bold); }) == 0,
+		"wrap_to(style) into a reserved string");
+	check(out == ansi::wrap("text", ansi::style::bold), "wrap_to(style) output");
+
+	char buffer[4096];
+	const std::span<char> span(buffer);
+	size_t written = 0;
+	check(count_allocations([&] { written = ansi::format_to(span, formatted); }) == 0, "format_to into a span");
+	check(std::string_view(buffer, written) == ansi::format(formatted), "format_to span output");
+	check(count_allocations([&] { written = ansi::strip_to(span, styled); }) == 0, "strip_to into a span");
+	check(std::string_view(buffer, written) == ansi::strip(styled), "strip_to span output");
+	check(count_allocations([&] { written = ansi::wrap_to(span, "text", pair); }) == 0, "wrap_to(pair) into a span");
+	check(std::string_view(buffer, written) == ansi::wrap("text", pair), "wrap_to(pair) span output");
+	check(count_allocations([&] { written = ansi::wrap_to(span, "text", ansi::style::bold); }) == 0,
+		"wrap_to(style) into a span");
+	check(std::string_view(buffer, written) == ansi::wrap("text", ansi::style::bold), "wrap_to(style) span output");
+
+	// A span that's too small gets a truncated copy and the full length.
+	const std::span<char> small(buffer, 4);
+	check(count_allocations([&] { written = ansi::strip_to(small, styled); }) == 0, "strip_to into a short span");
+	check(written == ansi::strip(styled).size() && std::string_view(buffer, 4) == "bold", "strip_to truncation");
+
+	return failures == 0? 0 : 1;
+}
@@ -0,0 +1,118 @@
+// Checks histogram's bucket bounds, its percentile error bound, and that merging and subtracting histograms agrees
+// with recording into one.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "performance.h"
+
+using formicine::histogram;
+
+namespace {
+	int failures = 0;
+	uint64_t state = 0x853c49e6748fea9bull;
+
+	uint64_t next() {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	void check(bool condition, const char *what, int precision, uint64_t value = 0) {
+		if (!condition) {
+			std::fprintf(stderr, "FAILED: %s (precision %d, value %llu)\n", what, precision,
+				static_cast<unsigned long long>(value));
+			++failures;
+		}
+	}
+
+	/** Returns a log-uniformly distributed duration below 2^40 ns, the range the histogram records exactly. */
+	uint64_t random_duration() {
+		const int bits = next() % histogram::range_bits;
+		return (next() & ((uint64_t(1) << bits) - 1)) | (uint64_t(1) << bits) >> 1;
+	}
+
+	bool same(const histogram &a, const histogram &b) {
+		if (a.count() != b.count() || a.sum() != b.sum() || a.min() != b.min() || a.max() != b.max())
+			return false;
+		for (size_t i = 0; i < a.bucket_count(); ++i) {
+			if (a.bucket(i) != b.bucket(i))
+				return false;
+		}
+		return true;
+	}
+}
+
+int main() {
+	for (const int precision: {0, 1, 4, histogram::max_precision}) {
+		const histogram hist(precision);
+
+		// Each power of two starts a bucket, and every value falls within the bounds of its bucket.
+		for (int bit = 0; bit < histogram::range_bits; ++bit) {
+			const uint64_t power = uint64_t(1) << bit;
+			check(hist.bucket_lower(hist.index(power)) == power, "power of two starts a bucket", precision, power);
+			check(hist.bucket_upper(hist.index(power - 1)) == power - 1, "power of two minus one ends a bucket",
+				precision, power - 1);
+			for (const uint64_t value: {power, power + power / 3, 2 * power - 1}) {
+				const size_t index = hist.index(value);
+				check(index < hist.bucket_count(), "index in range", precision, value);
+				check(hist.bucket_lower(index) <= value && value <= hist.bucket_upper(index), "value within bucket",
+					precision, value);
+			}
+		}
+		check(hist.bucket_lower(0) == 0, "first bucket starts at zero", precision);
+
+		// Percentiles are within the documented relative error of the exact percentiles of the recorded values.
+		histogram recorded(precision);
+		std::vector<uint64_t> values;
+		for (int i = 0; i < 5000; ++i) {
+			values.push_back(random_duration());
+			recorded.record(values.back());
+		}
+		std::sort(values.begin(), values.end());
+		const double bound = std::ldexp(1.0, -precision);
+		for (const double quantile: {0.0, 0.01, 0.25, 0.5, 0.9, 0.99, 0.999, 1.0}) {
+			const size_t rank = std::max<size_t>(1, std::ceil(quantile * values.size()));
+			const double exact = values[rank - 1];
+			const double estimate = recorded.value_at(quantile);
+			check(std::abs(estimate - exact) <= exact * bound, "percentile within the relative error", precision,
+				values[rank - 1]);
+		}
+
+		// Percentiles are clamped to the recorded extremes, and quantiles outside [0, 1] to those ends.
+		check(recorded.min() == values.front() && recorded.max() == values.back(), "exact extremes", precision);
+		check(values.front() <= recorded.value_at(0) && recorded.value_at(1) <= values.back(), "p0 and p100 clamped",
+			precision);
+		check(recorded.value_at(-1) == recorded.value_at(0) && recorded.value_at(2) == recorded.value_at(1),
+			"quantiles outside [0, 1] clamped", precision);
+		histogram single(precision);
+		single.record(1000003);
+		check(single.value_at(0) == 1000003 && single.value_at(0.5) == 1000003 && single.value_at(1) == 1000003,
+			"a single value is exact", precision);
+
+		// Merging two histograms gives the same one as recording everything into one, and since() undoes it.
+		histogram first(precision), second(precision), both(precision);
+		for (int i = 0; i < 2000; ++i) {
+			const uint64_t value = random_duration();
+			(i % 3 == 0? first : second).record(value);
+			both.record(value);
+		}
+		histogram merged(precision);
+		merged.merge(first);
+		merged.merge(second);
+		check(same(merged, both), "merge matches recording into one", precision);
+
+		histogram later(first);
+		later.merge(second);
+		const histogram difference = later.since(first);
+		check(difference.count() == second.count() && difference.sum() == second.sum(), "since counts", precision);
+		for (size_t i = 0; i < second.bucket_count(); ++i)
+			check(difference.bucket(i) == second.bucket(i), "since buckets", precision, i);
+	}
+
+	return failures == 0? 0 : 1;
+}
@@ -0,0 +1,114 @@
+// Checks html_stripper on edge cases, fed whole and in small chunks.
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+#include "futil.h"
+
+using namespace formicine;
+
+namespace {
+	int failures = 0;
+	uint64_t state = 0xbb67ae8584caa73bull;
+
+	uint64_t next(uint64_t bound) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state % bound;
+	}
+
+	void fail(const char *what, std::string_view input, const std::string &got) {
+		std::fprintf(stderr, "FAILED: %s: \"%.*s\" gave \"%s\"\n", what, int(input.size()), input.data(), got.c_str());
+		++failures;
+	}
+
+	std::string strip_whole(util::html_stripper &stripper, std::string_view input) {
+		std::string out;
+		stripper.feed(input, out);
+		stripper.finish(out);
+		return out;
+	}
+
+	/** Feeds a document in random chunks of one to three bytes. */
+	std::string strip_chunked(util::html_stripper &stripper, std::string_view input) {
+		std::string out;
+		for (size_t pos = 0; pos < input.size();) {
+			const size_t length = 1 + next(3);
+			stripper.feed(input.substr(pos, length), out);
+			pos += length;
+		}
+		stripper.finish(out);
+		return out;
+	}
+
+	/** Checks a document's stripped text, whole, in chunks, and through remove_html. */
+	void check(std::string_view input, std::string_view expected) {
+		util::html_stripper stripper;
+		const std::string whole = strip_whole(stripper, input);
+		if (whole != expected)
+			fail("whole", input, whole);
+		for (int i = 0; i < 20; ++i) {
+			// The same stripper is reused after finish().
+			const std::string chunked = strip_chunked(stripper, input);
+			if (chunked != expected)
+				fail("chunked", input, chunked);
+		}
+		const std::string removed = util::remove_html(std::string(input));
+		if (removed != expected)
+			fail("remove_html", input, removed);
+	}
+}
+
+int main() {
+	check("<p>one</p><br/>two", "onetwo");
+	check("<a href=\"x>y\" title='>'>link</a> text", "link text");
+	check("a<!-- c -- > still -->b", "ab");
+	check("a<!---->b", "ab");
+	check("<!DOCTYPE html><?xml version=\"1.0\"?>t", "t");
+
+	// CDATA is kept as text, and runs of ']' before the end belong to it.
+	check("<![CDATA[x]]]>y", "x]y");
+	check("<![CDATA[<b>&amp;]]>", "<b>&amp;");
+	check("<![CDATA[]]]]]>", "]]]");
+
+	// Script and style bodies are skipped up to a matching end tag in any case.
+	check("<STYLE>p{}</STYLE>after", "after");
+	check("<style>a</StYlE >b", "b");
+	check("<script>if (a</b) x;</script >done", "done");
+	check("<script>\"</scriptx>\"</script>z", "z");
+
+	// Character references.
+	check("&amp;&lt;&gt;&quot;&apos;&nbsp;&hellip;", "&<>\"' …");
+	check("&#233;&#xE9;&#x1F600;", "éé\U0001F600");
+	check("&#1114112;&#0;&#xD800;", "���");
+	check("&bogus; &#xZZ; &amp &", "&bogus; &#xZZ; &amp &");
+	check("x&am", "x&am");
+
+	// A '<' that can't begin a tag is kept.
+	check("5<6 and a < b", "5<6 and a < b");
+	check("a <", "a <");
+	check("text</", "text</");
+
+	// A tag still open at the end of the document is dropped.
+	check("text<a", "text");
+	check("text<a href=\"", "text");
+
+	// Random documents built from fragments that split markup, fed in chunks, match feeding them whole.
+	const std::string_view fragments[] = {"<", ">", "a", " ", "/", "!", "-", "--", "[", "]", "]]", "<![CDATA[", "\"",
+		"'", "=", "&", ";", "#", "x", "amp", "39", "<script>", "</script>", "</SCRIPT", "<style>", "?", "<!--", "-->"};
+	util::html_stripper whole, chunked;
+	for (int round = 0; round < 20000 && failures == 0; ++round) {
+		std::string input;
+		for (uint64_t count = next(16); count != 0; --count)
+			input += fragments[next(std::size(fragments))];
+		const std::string expected = strip_whole(whole, input);
+		const std::string got = strip_chunked(chunked, input);
+		if (got != expected)
+			fail("random chunks", input, got);
+	}
+
+	return failures == 0? 0 : 1;
+}
@@ -0,0 +1,109 @@
+// Checks replace_all and replacer against a naive replacer.
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <string_view>
+
+#include "futil.h"
+
+using namespace formicine;
+
+namespace {
+	int failures = 0;
+	uint64_t state = 0x6a09e667f3bcc909ull;
+
+	uint64_t next(uint64_t bound) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state % bound;
+	}
+
+	void check(const std::string &got, std::string_view expected, const char *what) {
+		if (got != expected) {
+			std::fprintf(stderr, "FAILED: %s: got \"%s\", expected \"%.*s\"\n", what, got.c_str(), int(expected.size()),
+				expected.data());
+			++failures;
+		}
+	}
+
+	/** At each position, replaces the longest pattern that starts there, or copies a character if none does. */
+	std::string naive_replace(std::string_view str, const std::map<std::string, std::string> &replacements) {
+		std::string out;
+		for (size_t pos = 0; pos < str.size();) {
+			const std::pair<const std::string, std::string> *longest = nullptr;
+			for (const auto &pair: replacements) {
+				if (!pair.first.empty() && str.substr(pos).starts_with(pair.first) &&
+				    (longest == nullptr || longest->first.size() < pair.first.size()))
+					longest = &pair;
+			}
+
+			if (longest == nullptr) {
+				out += str[pos++];
+			} else {
+				out += longest->second;
+				pos += longest->first.size();
+			}
+		}
+		return out;
+	}
+
+	std::string random_string(std::string_view alphabet, size_t max_length) {
+		std::string out;
+		for (size_t length = next(max_length + 1); out.size() < length;)
+			out += alphabet[next(alphabet.size())];
+		return out;
+	}
+}
+
+int main() {
+	// A single pattern.
+	check(util::replace_all("one two one", "one", "1"), "1 two 1", "single pattern");
+	check(util::replace_all("aaaa", "aa", "b"), "bb", "adjacent matches");
+	check(util::replace_all("aaa", "aa", "b"), "ba", "overlapping matches of one pattern");
+	check(util::replace_all("abc", "x", "y"), "abc", "no match");
+	check(util::replace_all("", "a", "b"), "", "empty string");
+	check(util::replace_all("abc", "", "x"), "abc", "empty pattern");
+	check(util::replace_all("abc", "b", ""), "ac", "empty replacement");
+
+	// Replacements aren't searched again.
+	check(util::replace_all("aaa", "a", "aa"), "aaaaaa", "a to aa");
+	check(util::replacer({{"a", "aa"}})("aaa"), "aaaaaa", "a to aa with a replacer");
+	check(util::replacer({{"a", "b"}, {"b", "a"}})("abba"), "baab", "swap");
+
+	// Empty patterns are ignored.
+	check(util::replacer({{"", "x"}, {"b", "y"}})("abc"), "ayc", "empty pattern among others");
+	check(util::replacer({{"", "x"}})("abc"), "abc", "only an empty pattern");
+
+	// Overlapping and prefix patterns: the match that starts first wins, and of those, the longest.
+	const util::replacer prefixes({{"a", "1"}, {"ab", "2"}, {"abc", "3"}});
+	check(prefixes("abcab a"), "32 1", "prefix patterns");
+	check(util::replacer({{"abcd", "X"}, {"bc", "Y"}})("abcd abc"), "X aY", "overlap won by the earlier start");
+	check(util::replacer({{"bcd", "X"}, {"ab", "Y"}})("abcd"), "Ycd", "earlier start beats a longer match");
+	check(util::replacer({{"he", "1"}, {"she", "2"}, {"his", "3"}, {"hers", "4"}})("ushers"), "u2rs", "suffix links");
+	check(util::replace_all("x-y", std::map<std::string, std::string> {{"-", "+"}, {"x", "-"}}), "-+y",
+		"map overload");
+
+	// Random patterns over a small alphabet, where matches overlap often.
+	for (int round = 0; round < 3000 && failures == 0; ++round) {
+		std::map<std::string, std::string> replacements;
+		for (uint64_t count = next(5); replacements.size() < count;)
+			replacements[random_string("abc", 3)] = random_string("abcX", 3);
+		const util::replacer replace(replacements);
+		for (int i = 0; i < 5; ++i) {
+			const std::string str = random_string("abc", 20);
+			check(replace(str), naive_replace(str, replacements), "random replacements");
+		}
+
+		if (replacements.size() == 1) {
+			const std::string str = random_string("abc", 20);
+			const auto &[pattern, replacement] = *replacements.begin();
+			check(util::replace_all(str, pattern, replacement), naive_replace(str, replacements),
+				"random single pattern");
+		}
+	}
+
+	return failures == 0? 0 : 1;
+}
@@ -0,0 +1,64 @@
+// Checks the bytes screen::present() writes: only changed cells, with short cursor moves and SGR changes.
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+#include "screen.h"
+
+namespace {
+	int failures = 0;
+
+	/** Presents a screen and checks what it wrote to the stream and how many cells it drew. */
+	void check(ansi::screen &screen, std::ostringstream &stream, std::string_view expected, size_t cells,
+	const char *what) {
+		const size_t drawn = screen.present();
+		const std::string written = stream.str();
+		stream.str("");
+		if (written != expected || drawn != cells) {
+			std::string shown;
+			for (const char ch: written)
+				shown += ch == '\x1b'? std::string("\\e") : ch == '\r'? std::string("\\r") : std::string(1, ch);
+			std::fprintf(stderr, "FAILED: %s: drew %zu cells: \"%s\"\n", what, drawn, shown.c_str());
+			++failures;
+		}
+	}
+}
+
+int main() {
+	std::ostringstream stream;
+	ansi::ansistream as(stream, stream);
+	ansi::screen screen(as, 6, 2);
+
+	ansi::sgr_state red, bold;
+	red.fg = ansi::color::red;
+	bold.styles = ansi::style_bit(ansi::style::bold);
+
+	// The first frame clears the terminal and draws only the cells that aren't blank.
+	screen.write(0, 0, "hello", red);
+	check(screen, stream, "\e[2J\e[1;1H\e[31mhello", 5, "first frame");
+
+	// Later frames draw only changed cells. The cursor returns to the first column with \r, skips ahead on the same
+	// row with a relative move and jumps to other rows, and SGR changes use the shortest escape.
+	screen.set(0, 0, {U'H', red});
+	screen.set(4, 0, {U'O', red});
+	screen.set(2, 1, {U'x', bold});
+	screen.set(3, 1, {U'y', bold});
+	check(screen, stream, "\rH\e[3CO\e[2;3H\e[0;1mxy", 4, "changed cells");
+
+	// Nothing changed, so nothing is written.
+	check(screen, stream, "", 0, "unchanged frame");
+
+	// A NUL is drawn as a space, so the cursor stays where it's tracked, and multibyte glyphs are encoded as UTF-8.
+	screen.set(1, 0, {U'\0', red});
+	screen.set(5, 1, {U'é', {}});
+	check(screen, stream, "\e[1;2H\e[0;31m \e[2;6H\e[0mé", 2, "NUL and UTF-8 glyphs");
+
+	// Setting a cell back to what's on the terminal draws nothing.
+	screen.set(0, 0, {U'x', {}});
+	screen.set(0, 0, {U'H', red});
+	check(screen, stream, "", 0, "cell restored before presenting");
+
+	return failures == 0? 0 : 1;
+}
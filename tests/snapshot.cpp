@@ -0,0 +1,117 @@
+// Checks that snapshots survive a round trip through JSON and that compare() flags only real regressions.
+
+#include <cstdint>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "performance.h"
+
+using formicine::performance;
+
+namespace {
+	int failures = 0;
+	uint64_t state = 0xda942042e4dd58b5ull;
+
+	void check(bool condition, const char *what) {
+		if (!condition) {
+			std::fprintf(stderr, "FAILED: %s\n", what);
+			++failures;
+		}
+	}
+
+	/** Returns a roughly normally distributed duration around a mean. */
+	uint64_t random_duration(uint64_t mean) {
+		double sum = 0;
+		for (int i = 0; i < 12; ++i) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			sum += (state >> 11) * 0x1p-53;
+		}
+		return static_cast<uint64_t>(mean * (1 + (sum - 6) * 0.05));
+	}
+
+	/** Returns a snapshot entry for a timer that recorded a number of durations around a mean. */
+	performance::stats_snapshot::entry make_timer(const std::string &name, uint64_t mean, int count) {
+		performance::stats_snapshot::entry entry {0, name, {}};
+		performance::timer_stats &stats = entry.stats;
+		for (int i = 0; i < count; ++i)
+			stats.distribution.record(random_duration(mean));
+		stats.count = stats.distribution.count();
+		stats.invocations = stats.count + 7;
+		stats.total = performance::timetype(stats.distribution.sum());
+		stats.min = performance::timetype(stats.distribution.min());
+		stats.max = performance::timetype(stats.distribution.max());
+		return entry;
+	}
+}
+
+int main() {
+	// Write a snapshot as JSON and read it back.
+	performance::stats_snapshot original;
+	original.timers.push_back(make_timer("parse", 40000, 1000));
+	original.timers.push_back(make_timer("quote \" backslash \\ tab \t é", 2500000, 300));
+	original.timers.push_back(make_timer("single", 123, 1));
+	original.timers[0].stats.counters[static_cast<size_t>(formicine::counter::cache_misses)] = 4242;
+	original.timers[0].stats.counted[static_cast<size_t>(formicine::counter::cache_misses)] = 1000;
+
+	std::stringstream json;
+	performance::write_json(json, original);
+	const performance::stats_snapshot restored = performance::read_json(json);
+	check(restored.timers.size() == original.timers.size(), "timer count");
+	for (const performance::stats_snapshot::entry &before: original.timers) {
+		const performance::stats_snapshot::entry *after = nullptr;
+		for (const performance::stats_snapshot::entry &entry: restored.timers) {
+			if (entry.name == before.name)
+				after = &entry;
+		}
+
+		if (after == nullptr) {
+			check(false, "timer name");
+			continue;
+		}
+
+		check(after->stats.count == before.stats.count && after->stats.invocations == before.stats.invocations,
+			"counts");
+		check(after->stats.total == before.stats.total && after->stats.min == before.stats.min &&
+			after->stats.max == before.stats.max, "total and extremes");
+		check(after->stats.counters == before.stats.counters && after->stats.counted == before.stats.counted,
+			"counters");
+		for (const double percent: {0.0, 1.0, 50.0, 90.0, 99.0, 99.9, 100.0})
+			check(after->stats.percentile(percent) == before.stats.percentile(percent), "percentiles");
+	}
+
+	bool threw = false;
+	try {
+		std::istringstream malformed("{\"timers\":[{\"name\":\"x\"");
+		performance::read_json(malformed);
+	} catch (const std::runtime_error &) {
+		threw = true;
+	}
+	check(threw, "malformed JSON throws");
+
+	// A clearly slower distribution is a regression; a sample from the same distribution isn't.
+	performance::stats_snapshot baseline, current;
+	baseline.timers.push_back(make_timer("shifted", 100000, 500));
+	baseline.timers.push_back(make_timer("unchanged", 100000, 500));
+	current.timers.push_back(make_timer("shifted", 130000, 500));
+	current.timers.push_back(make_timer("unchanged", 100000, 500));
+	const auto comparisons = performance::compare(baseline, current);
+	check(comparisons.size() == 2, "both timers compared");
+	for (const performance::comparison &result: comparisons) {
+		if (result.name == "shifted")
+			check(result.regressed && result.p_value < 0.01 && 0.2 < result.p50_change, "shifted regressed");
+		else
+			check(!result.regressed && 0.01 <= result.p_value, "unchanged didn't regress");
+	}
+
+	// Comparing a snapshot with itself finds nothing, and faster timers aren't regressions.
+	for (const performance::comparison &result: performance::compare(current, current))
+		check(!result.regressed, "identical snapshot didn't regress");
+	for (const performance::comparison &result: performance::compare(current, baseline))
+		check(!result.regressed, "faster timer didn't regress");
+
+	return failures == 0? 0 : 1;
+}
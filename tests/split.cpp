@@ -0,0 +1,70 @@
+// Checks that split_view yields the same tokens as split(), and the word helpers built on it.
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "futil.h"
+
+using namespace formicine;
+
+namespace {
+	int failures = 0;
+	uint64_t state = 0x3c6ef372fe94f82bull;
+
+	uint64_t next(uint64_t bound) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state % bound;
+	}
+
+	void check(bool condition, const char *what, std::string_view str = {}) {
+		if (!condition) {
+			std::fprintf(stderr, "FAILED: %s: \"%.*s\"\n", what, int(str.size()), str.data());
+			++failures;
+		}
+	}
+
+	bool same_tokens(const util::split_view &view, const std::vector<std::string> &expected) {
+		std::vector<std::string> tokens;
+		for (const std::string_view token: view)
+			tokens.emplace_back(token);
+		return tokens == expected;
+	}
+}
+
+int main() {
+	// Random strings and delimiters, by string and by character, with and without condensing.
+	const std::string delimiters[] = {" ", ",", ", ", "ab", "--", "aba"};
+	for (int round = 0; round < 20000 && failures == 0; ++round) {
+		std::string str;
+		for (uint64_t length = next(16); str.size() < length;)
+			str += "ab, -"[next(5)];
+		const std::string &delimiter = delimiters[next(std::size(delimiters))];
+		for (const bool condense: {true, false}) {
+			const std::vector<std::string> expected = util::split(str, delimiter, condense);
+			check(same_tokens(util::split_view(str, delimiter, condense), expected), "split_view by string", str);
+			if (delimiter.size() == 1)
+				check(same_tokens(util::split_view(str, delimiter[0], condense), expected), "split_view by char", str);
+		}
+	}
+
+	check(same_tokens(util::split_view("", ","), {}), "empty string has no tokens");
+	check(same_tokens(util::split_view("a,b", ""), {"a,b"}), "empty delimiter yields the whole string");
+	check(same_tokens(util::split_view(",,a,,b,,", ',', true), {"", "a", "b"}), "condense keeps the first token");
+	check(same_tokens(util::split_view(",,a,", ',', false), {"", "", "a", ""}), "uncondensed empty tokens");
+
+	// word_count used to underflow on two or more trailing spaces, and nth_word used to wrap past the last word.
+	check(util::word_count("a  ", true) == 1, "word_count with trailing spaces");
+	check(util::word_count("  a  b  ", true) == 2, "word_count with surrounding spaces");
+	check(util::word_count("a  b", false) == 3, "uncondensed word_count");
+	check(util::word_count("", true) == 0 && util::word_count("", false) == 0, "word_count of an empty string");
+	check(util::nth_word("a b", 1, false) == "b" && util::nth_word("a  b", 2, false) == "b", "nth_word");
+	check(util::nth_word("a b", 2, false).empty() && util::nth_word("a b", 7, false).empty(), "nth_word past the end");
+	check(util::nth_word("a  b", 1, true) == "b" && util::nth_word("a  b", 2, true).empty(), "condensed nth_word");
+
+	return failures == 0? 0 : 1;
+}
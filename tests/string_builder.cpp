@@ -0,0 +1,75 @@
+// Checks string_builder's overload selection and its std::to_chars formatting of floating-point numbers.
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <type_traits>
+
+#include "futil.h"
+
+using formicine::util::string_builder;
+
+static_assert(!std::is_convertible_v<size_t, string_builder>, "a size shouldn't convert to a builder");
+
+namespace {
+	int failures = 0;
+
+	void check(const string_builder &builder, std::string_view expected, const char *what) {
+		if (builder.view() != expected) {
+			std::fprintf(stderr, "FAILED: %s: got \"%.*s\", expected \"%.*s\"\n", what, int(builder.size()),
+				builder.view().data(), int(expected.size()), expected.data());
+			++failures;
+		}
+	}
+
+	template <typename T>
+	std::string built(const T &value) {
+		return (string_builder() << value).str();
+	}
+
+	/** Formats a double with printf for comparison. */
+	std::string printed(const char *format, double value) {
+		char out[512];
+		const int length = std::snprintf(out, sizeof(out), format, value);
+		return std::string(out, length);
+	}
+}
+
+int main() {
+	// Overload selection: strings stay strings, characters stay characters and bools become 1 or 0.
+	const char *pointer = "pointer";
+	check(string_builder() << "literal", "literal", "string literal");
+	check(string_builder() << pointer, "pointer", "const char *");
+	check(string_builder() << std::string("string") << std::string_view("view"), "stringview", "std::string");
+	check(string_builder() << true << false, "10", "bool");
+	check(string_builder() << 'c' << static_cast<signed char>('s') << static_cast<unsigned char>('u'), "csu",
+		"characters");
+	check(string_builder() << 42 << -7L << uint64_t(18446744073709551615ull) << short(-32768),
+		"42-718446744073709551615-32768", "integers");
+	check(string_builder().append(3, 'x'), "xxx", "repeated character");
+
+	// The shortest representation that reads back as the same value.
+	check(string_builder() << 0.1 << ' ' << 0.1f << ' ' << 1e21 << ' ' << -0.0 << ' ' << 2.5, "0.1 0.1 1e+21 -0 2.5",
+		"shortest floats");
+	for (const double value: {0.1 + 0.2, 1.0 / 3, 6.02214076e23, 5e-324, std::numeric_limits<double>::max()}) {
+		const std::string text = built(value);
+		double parsed = 0;
+		std::from_chars(text.data(), text.data() + text.size(), parsed);
+		if (parsed != value) {
+			std::fprintf(stderr, "FAILED: round trip of %s\n", text.c_str());
+			++failures;
+		}
+	}
+
+	// A format and precision, matching printf, including fixed notation too long for the builder's stack buffer.
+	for (const double value: {0.0, 1.5, -12345.678, 1e-7, 6.02214076e23, 1e300, -std::numeric_limits<double>::max()}) {
+		check(string_builder().append(value, std::chars_format::fixed, 3), printed("%.3f", value), "fixed");
+		check(string_builder().append(value, std::chars_format::scientific, 4), printed("%.4e", value), "scientific");
+		check(string_builder().append(value, std::chars_format::general, 6), printed("%.6g", value), "general");
+	}
+	check(string_builder().append(1e300, std::chars_format::fixed, 40), printed("%.40f", 1e300), "long fixed");
+
+	return failures == 0? 0 : 1;
+}
@@ -0,0 +1,94 @@
+// Checks that styled_string's incremental reindexing after each edit matches a fresh index of the same text.
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+#include "ansi.h"
+
+namespace {
+	int failures = 0;
+
+	/** Compares an edited styled_string with one built from scratch from the same text. */
+	void check(const ansi::styled_string &edited, const char *what) {
+		const ansi::styled_string fresh(edited.str());
+		bool same = edited.length() == fresh.length();
+		for (size_t pos = 0; same && pos <= fresh.length() + 1; ++pos) {
+			same = edited.get_pos(pos) == fresh.get_pos(pos);
+			for (size_t n = 0; same && pos + n <= fresh.length() + 1; ++n)
+				same = edited.substr(pos, n) == fresh.substr(pos, n);
+		}
+
+		if (!same) {
+			std::string shown;
+			for (const char ch: edited.str())
+				shown += ch == '\x1b'? std::string("\\e") : std::string(1, ch);
+			std::fprintf(stderr, "FAILED: %s: \"%s\"\n", what, shown.c_str());
+			++failures;
+		}
+	}
+}
+
+int main() {
+	// An escape completed by an append.
+	ansi::styled_string str("ab\e[3");
+	check(str, "partial escape");
+	str.append("1mcd");
+	check(str, "append completing an escape");
+	str += "\e";
+	check(str, "append of a lone escape character");
+	str += "[0mef";
+	check(str, "append completing a trailing escape");
+
+	// An escape formed by an insertion in front of its parameters.
+	str = "a31mb";
+	str.insert(1, "\e[");
+	check(str, "insert forming an escape");
+	str.insert(0, '\e');
+	check(str, "insert of an escape character");
+
+	// Erasing the text between escapes, and escapes separated by an erase.
+	str = "x\e[1my\e[22mz\e[31mw\e[39m";
+	str.erase(1, 1);
+	check(str, "erase between escapes");
+	str.erase(1, 1);
+	check(str, "erase making escapes adjacent");
+	str.erase(0);
+	check(str, "erase to the end");
+	str.append("\e[1");
+	str.insert(0, "q");
+	check(str, "insert before an unterminated escape");
+
+	// Random edits built from fragments that often split escapes.
+	const std::string_view fragments[] = {"a", "bc", " ", "\e", "[", "31", "m", ";", "\e[1m", "\e[0m", "\e[38;5;153m"};
+	uint64_t state = 0x9e3779b97f4a7c15ull;
+	auto next = [&](uint64_t bound) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state % bound;
+	};
+
+	for (int round = 0; round < 200 && failures == 0; ++round) {
+		ansi::styled_string random;
+		for (int edit = 0; edit < 30 && failures == 0; ++edit) {
+			const std::string_view fragment = fragments[next(std::size(fragments))];
+			switch (next(3)) {
+				case 0:
+					random.append(fragment);
+					check(random, "random append");
+					break;
+				case 1:
+					random.insert(next(random.length() + 1), fragment);
+					check(random, "random insert");
+					break;
+				default:
+					random.erase(next(random.length() + 1), next(4));
+					check(random, "random erase");
+			}
+		}
+	}
+
+	return failures == 0? 0 : 1;
+}
@@ -0,0 +1,102 @@
+// Checks the word-position helpers against word_index, and word_index::update() against a fresh index.
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+#include "futil.h"
+
+using namespace formicine;
+
+namespace {
+	int failures = 0;
+	uint64_t state = 0x2545f4914f6cdd1dull;
+
+	uint64_t next(uint64_t bound) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state % bound;
+	}
+
+	void fail(const char *what, const std::string &str) {
+		std::fprintf(stderr, "FAILED: %s: \"%s\"\n", what, str.c_str());
+		++failures;
+	}
+
+	bool same(const util::word_index &a, const util::word_index &b) {
+		if (a.size() != b.size())
+			return false;
+		for (size_t n = 0; n < a.size(); ++n) {
+			if (a[n].start != b[n].start || a[n].end != b[n].end)
+				return false;
+		}
+		return true;
+	}
+
+	/** Returns a short string of words and runs of spaces. */
+	std::string random_text(size_t max_length) {
+		static constexpr std::string_view alphabet = "ab  ";
+		std::string out;
+		for (size_t length = next(max_length + 1); out.size() < length;)
+			out += alphabet[next(alphabet.size())];
+		return out;
+	}
+
+	/** Compares the free functions, which stop scanning early, with the answers of a full index. */
+	void check_helpers(const std::string &str) {
+		const util::word_index index(str);
+		for (size_t cursor = 0; cursor <= str.size() + 1; ++cursor) {
+			if (util::word_indices(str, cursor) != index.locate(cursor))
+				fail("word_indices", str);
+		}
+
+		if (util::word_indices(str, std::string::npos) != index.locate(std::string::npos))
+			fail("word_indices past the end", str);
+
+		for (size_t n = 0; n <= index.size() + 1; ++n) {
+			if (util::index_of_word(str, n) != index.start_of(n))
+				fail("index_of_word", str);
+			if (util::last_index_of_word(str, n) != index.end_of(n))
+				fail("last_index_of_word", str);
+			if (util::skip_words(str, n) != str.substr(index.start_of(n)))
+				fail("skip_words", str);
+
+			std::string replaced = str, expected = str;
+			util::word_index updated(expected);
+			const ssize_t end = util::replace_word(replaced, n, "xyz");
+			if (end != updated.replace_word(expected, n, "xyz") || replaced != expected)
+				fail("replace_word", str);
+		}
+	}
+}
+
+int main() {
+	for (const std::string str: {"", " ", "a", " a ", "ab  cd", "  ab cd  ef  ", "a b c"})
+		check_helpers(str);
+	for (int round = 0; round < 500; ++round)
+		check_helpers(random_text(12));
+
+	// Chains of edits reported to update() should leave the same index as scanning the final string.
+	for (int round = 0; round < 500 && failures == 0; ++round) {
+		std::string str = random_text(16);
+		util::word_index index(str);
+		for (int edit = 0; edit < 20 && failures == 0; ++edit) {
+			if (next(4) == 0 && index.size() != 0) {
+				index.replace_word(str, next(index.size()), random_text(3));
+			} else {
+				const size_t pos = next(str.size() + 1);
+				const size_t erased = next(str.size() - pos + 1);
+				const std::string inserted = random_text(4);
+				str.replace(pos, erased, inserted);
+				index.update(str, pos, erased, inserted.size());
+			}
+
+			if (!same(index, util::word_index(str)))
+				fail("update", str);
+		}
+	}
+
+	return failures == 0? 0 : 1;
+}